@@ -0,0 +1,327 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include "BytePattern.h"
+#include "PatternSet.h"
+#include "BytePatternStatic.h"
+
+//pattern engine benchmark, run without arguments for the defaults:
+//	bench [-size MB] [-repeat N] [-seed N] [-file path] [-format csv|json]
+//every line reports one corpus/shape/anchor mode combination scanned with FindAll
+
+struct Corpus {
+	std::string name;
+	std::vector<uint8_t> data;
+	ByteFrequency *frequency;
+};
+
+struct Shape {
+	std::string name;
+	std::string pattern;
+};
+
+struct Options {
+	size_t size;
+	int repeat;
+	unsigned seed;
+	const char *file;
+	bool json;
+};
+
+static void FillRandom(std::vector<uint8_t>& data, std::mt19937& rng) {
+	for (auto& byte : data) {
+		byte = static_cast<uint8_t>(rng());
+	}
+}
+
+//instruction templates, 'r' bytes are random operands
+static const char *kCodeTemplates[] = {
+	"55", "8B EC", "83 EC r", "53", "56", "57", "8B 45 r", "8B 4D r", "89 45 r", "8B 0D r r r r",
+	"A1 r r r r", "E8 r r r r", "85 C0", "74 r", "75 r", "0F 84 r r r r", "33 C0", "5F", "5E", "5B",
+	"8B E5", "5D", "C3", "C2 r 00", "FF 15 r r r r", "68 r r r r", "6A r", "8D 4D r", "C7 45 r r r r r",
+	"3B C1", "8B 44 24 r", "89 44 24 r", "CC", "90", "00 00",
+};
+
+static void FillCode(std::vector<uint8_t>& data, std::mt19937& rng) {
+	const size_t count = sizeof(kCodeTemplates) / sizeof(kCodeTemplates[0]);
+	size_t pos = 0;
+	while (pos < data.size()) {
+		const char *tmpl = kCodeTemplates[rng() % count];
+		for (const char *c = tmpl; *c && pos < data.size(); ) {
+			if (*c == ' ') {
+				++c;
+			}
+			else if (*c == 'r') {
+				data[pos++] = static_cast<uint8_t>(rng());
+				++c;
+			}
+			else {
+				data[pos++] = static_cast<uint8_t>(strtoul(std::string(c, 2).c_str(), NULL, 16));
+				c += 2;
+			}
+		}
+	}
+}
+
+static bool LoadFile(const char *path, std::vector<uint8_t>& data) {
+	FILE *file = nullptr;
+	if (fopen_s(&file, path, "rb") != 0 || !file) {
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data.resize(size > 0 ? size : 0);
+	bool ok = data.empty() || fread(&data[0], 1, data.size(), file) == data.size();
+	fclose(file);
+	return ok;
+}
+
+//renders len bytes of the corpus at pos, every wildcard_every-th byte (0 = none) as ??
+static std::string Sample(const std::vector<uint8_t>& data, size_t pos, size_t len, size_t wildcard_every) {
+	std::string rv;
+	char hex[4];
+	for (size_t i = 0; i < len; ++i) {
+		if (i) {
+			rv += ' ';
+		}
+		if (wildcard_every && i % wildcard_every == wildcard_every - 1) {
+			rv += "??";
+		}
+		else {
+			sprintf_s(hex, "%02X", data[pos + i]);
+			rv += hex;
+		}
+	}
+	return rv;
+}
+
+static std::vector<Shape> MakeShapes(const Corpus& corpus, std::mt19937& rng) {
+	const std::vector<uint8_t>& data = corpus.data;
+	auto at = [&](size_t len) -> size_t {
+		return data.size() > len ? rng() % (data.size() - len) : 0;
+	};
+
+	//the rarest byte of the corpus, for a signature that starts on an unusual opcode
+	int rare = 0;
+	for (int i = 1; i < 0x100; ++i) {
+		if (corpus.frequency->bytes[i] < corpus.frequency->bytes[rare]) {
+			rare = i;
+		}
+	}
+	char rare_hex[4];
+	sprintf_s(rare_hex, "%02X", rare);
+
+	std::vector<Shape> shapes;
+	Shape shape;
+	shape.name = "short";
+	shape.pattern = Sample(data, at(6), 6, 0);
+	shapes.push_back(shape);
+	shape.name = "long";
+	shape.pattern = Sample(data, at(96), 96, 24);
+	shapes.push_back(shape);
+	shape.name = "leading_wildcards";
+	shape.pattern = "?? ?? ?? ?? " + Sample(data, at(8), 8, 0);
+	shapes.push_back(shape);
+	shape.name = "common_anchor";
+	shape.pattern = "00 00 ?? 00 00 00 ?? ?? 00";
+	shapes.push_back(shape);
+	shape.name = "rare_anchor";
+	shape.pattern = std::string(rare_hex) + " ?? " + Sample(data, at(6), 6, 0);
+	shapes.push_back(shape);
+	shape.name = "many_segments";
+	shape.pattern = Sample(data, at(32), 32, 2);
+	shapes.push_back(shape);
+	shape.name = "nibbles";
+	shape.pattern = "8B 4? ?? E8 ?? ?? ?? ?? 8? C0";
+	shapes.push_back(shape);
+	shape.name = "alternation";
+	shape.pattern = "E8|E9 ?? ?? ?? ?? 83|85 C0|C4";
+	shapes.push_back(shape);
+	return shapes;
+}
+
+//per verification block rejections joined by '/', trailing empty blocks dropped
+static std::string FormatRejects(const ScanStats& stats) {
+	size_t used = ScanStats::kBlocks;
+	while (used > 1 && stats.rejected[used - 1] == 0) {
+		--used;
+	}
+	std::string text;
+	for (size_t i = 0; i < used; ++i) {
+		text += (i ? "/" : "") + std::to_string(static_cast<unsigned long long>(stats.rejected[i]));
+	}
+	return text;
+}
+
+static void Report(const Options& options, const Corpus& corpus, const std::string& shape, const char *mode, size_t len, double seconds, const ScanStats& stats, uint64_t matches) {
+	double bytes = static_cast<double>(corpus.data.size()) * options.repeat;
+	double gbps = seconds > 0 ? bytes / seconds / 1e9 : 0;
+	std::string rejects = FormatRejects(stats);
+	if (options.json) {
+		printf("{\"corpus\":\"%s\",\"shape\":\"%s\",\"anchors\":\"%s\",\"pattern_bytes\":%u,\"bytes\":%.0f,\"seconds\":%.6f,\"gbps\":%.3f,\"candidates\":%llu,\"rejects\":\"%s\",\"class_rejects\":%llu,\"matches\":%llu}\n",
+			corpus.name.c_str(), shape.c_str(), mode, static_cast<unsigned>(len), bytes, seconds, gbps,
+			static_cast<unsigned long long>(stats.candidates), rejects.c_str(), static_cast<unsigned long long>(stats.rejected_classes),
+			static_cast<unsigned long long>(matches));
+	}
+	else {
+		printf("%s,%s,%s,%u,%.0f,%.6f,%.3f,%llu,%s,%llu,%llu\n",
+			corpus.name.c_str(), shape.c_str(), mode, static_cast<unsigned>(len), bytes, seconds, gbps,
+			static_cast<unsigned long long>(stats.candidates), rejects.c_str(), static_cast<unsigned long long>(stats.rejected_classes),
+			static_cast<unsigned long long>(matches));
+	}
+}
+
+static void RunShape(const Options& options, const Corpus& corpus, const Shape& shape) {
+	Pattern *pattern = BytePattern::CreatePattern(shape.pattern.c_str());
+	if (!pattern || corpus.data.empty()) {
+		BytePattern::DestroyPattern(pattern);
+		return;
+	}
+
+	const char *modes[] = { "default", "frequency" };
+	for (int mode = 0; mode < 2; ++mode) {
+		const ByteFrequency *frequency = mode ? corpus.frequency : nullptr;
+		uint64_t matches = 0;
+		BytePattern::ResetStats();
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < options.repeat; ++i) {
+			matches += BytePattern::FindAll(pattern, &corpus.data[0], corpus.data.size(), [](const void *) {
+				return true;
+			}, 0, frequency);
+		}
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		Report(options, corpus, shape.name, modes[mode], pattern->span, elapsed.count(), BytePattern::stats(), matches);
+	}
+	BytePattern::DestroyPattern(pattern);
+}
+
+//one pass over the corpus for a set built from every shape plus sampled signatures
+static void RunSet(const Options& options, const Corpus& corpus, const std::vector<Shape>& shapes, std::mt19937& rng) {
+	std::vector<std::string> sources;
+	for (auto& shape : shapes) {
+		sources.push_back(shape.pattern);
+	}
+	while (sources.size() < 256 && corpus.data.size() > 24) {
+		sources.push_back(Sample(corpus.data, rng() % (corpus.data.size() - 24), 24, 7));
+	}
+	std::vector<const char *> patterns;
+	for (auto& source : sources) {
+		patterns.push_back(source.c_str());
+	}
+
+	PatternSet *set = BytePatternSet::CreatePatternSet(patterns);
+	if (!set) {
+		return;
+	}
+	uint64_t matches = 0;
+	std::vector<const void *> results;
+	BytePattern::ResetStats();
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < options.repeat; ++i) {
+		BytePatternSet::Find(set, &corpus.data[0], corpus.data.size(), results);
+		for (auto hit : results) {
+			matches += hit ? 1 : 0;
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+	Report(options, corpus, "set_" + std::to_string(static_cast<unsigned long long>(sources.size())), "set", set->max_span, elapsed.count(), BytePattern::stats(), matches);
+	BytePatternSet::DestroyPatternSet(set);
+}
+
+//the same signature compiled at runtime and as a template literal
+static void RunLiteral(const Options& options, const Corpus& corpus) {
+	typedef BytePatternLiteral<0x8B, 0x0D, kAnyByte, kAnyByte, kAnyByte, kAnyByte, 0x85, 0xC0> Literal;
+	Shape shape;
+	shape.name = "literal";
+	shape.pattern = "8B 0D ?? ?? ?? ?? 85 C0";
+	RunShape(options, corpus, shape);
+	if (corpus.data.empty()) {
+		return;
+	}
+
+	uint64_t matches = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < options.repeat; ++i) {
+		matches += Literal::FindAll(&corpus.data[0], corpus.data.size(), [](const void *) {
+			return true;
+		});
+	}
+	std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+	ScanStats none = {};
+	Report(options, corpus, shape.name, "template", Literal::kSize, elapsed.count(), none, matches);
+}
+
+int main(int argc, const char *argv[]) {
+	Options options;
+	options.size = 64;
+	options.repeat = 3;
+	options.seed = 1;
+	options.file = NULL;
+	options.json = false;
+
+	for (int i = 1; i < argc; ++i) {
+		bool has_value = i + 1 < argc;
+		if (strcmp(argv[i], "-size") == 0 && has_value) {
+			options.size = strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "-repeat") == 0 && has_value) {
+			options.repeat = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-seed") == 0 && has_value) {
+			options.seed = strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "-file") == 0 && has_value) {
+			options.file = argv[++i];
+		}
+		else if (strcmp(argv[i], "-format") == 0 && has_value) {
+			options.json = strcmp(argv[++i], "json") == 0;
+		}
+		else {
+			fprintf(stderr, "usage: %s [-size MB] [-repeat N] [-seed N] [-file path] [-format csv|json]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (options.repeat < 1) {
+		options.repeat = 1;
+	}
+
+	std::mt19937 rng(options.seed);
+	std::vector<Corpus> corpora(2);
+	corpora[0].name = "random";
+	corpora[0].data.resize(options.size * 1024 * 1024);
+	FillRandom(corpora[0].data, rng);
+	corpora[1].name = "x86";
+	corpora[1].data.resize(options.size * 1024 * 1024);
+	FillCode(corpora[1].data, rng);
+	if (options.file) {
+		Corpus file;
+		file.name = "file";
+		if (!LoadFile(options.file, file.data)) {
+			fprintf(stderr, "cannot read %s\n", options.file);
+			return 1;
+		}
+		corpora.push_back(file);
+	}
+
+	if (!options.json) {
+		printf("corpus,shape,anchors,pattern_bytes,bytes,seconds,gbps,candidates,rejects,class_rejects,matches\n");
+	}
+	for (auto& corpus : corpora) {
+		corpus.frequency = new ByteFrequency();
+		BytePattern::ComputeFrequency(corpus.data.empty() ? NULL : &corpus.data[0], corpus.data.size(), *corpus.frequency);
+		std::vector<Shape> shapes = MakeShapes(corpus, rng);
+		for (auto& shape : shapes) {
+			RunShape(options, corpus, shape);
+		}
+		RunSet(options, corpus, shapes, rng);
+		RunLiteral(options, corpus);
+		delete corpus.frequency;
+	}
+	return 0;
+}
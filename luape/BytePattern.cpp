@@ -1,136 +1,949 @@
 #include "BytePattern.h"
-#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+#include <intrin.h>
+#include <immintrin.h>
 
-struct Segment {
-	int pos;
-	std::vector<uint8_t> bytes;
+#ifdef BYTE_PATTERN_STATS
+static ScanStats Stats;
+#define COUNT_STAT(field) (++Stats.field)
+#define COUNT_REJECT(offset) (++Stats.rejected[std::min<size_t>((offset) / 16, ScanStats::kBlocks - 1)])
+#else
+#define COUNT_STAT(field)
+#define COUNT_REJECT(offset)
+#endif
+
+//bytes that dominate typical x86 code and data, most frequent first
+static const uint8_t kCommonBytes[] = {
+	0x00, 0xFF, 0xCC, 0x8B, 0x48, 0x89, 0x24, 0x44, 0x45, 0x4C, 0x83, 0xE8, 0x0F, 0x01, 0x04, 0x08,
+	0x10, 0x85, 0x74, 0x75, 0xC3, 0xC7, 0x8D, 0x90, 0x55, 0x56, 0x57, 0x50, 0x51, 0x53, 0x5D, 0x5E,
+	0x5F, 0xEC, 0xE5, 0x33, 0xC0, 0x40, 0x20, 0x80, 0x02, 0x03, 0x0C, 0x14, 0x18, 0x1C, 0x28, 0x30,
 };
 
-Pattern * BytePattern::CreatePattern(const char *pattern) {
-	Pattern *dst = new Pattern();
+int BytePattern::Commonness(uint8_t byte) {
+	for (size_t i = 0; i < sizeof(kCommonBytes); ++i) {
+		if (kCommonBytes[i] == byte) {
+			return static_cast<int>(sizeof(kCommonBytes) - i);
+		}
+	}
+	return 0;
+}
+
+//picks the two least common literal bytes, the scanner only verifies positions where both match
+static void ChooseAnchors(Pattern& compiled) {
+	int best[2] = { -1, -1 };
+	int best_score[2] = { 0, 0 };
+	uint8_t best_byte[2] = { 0, 0 };
+	for (auto& s : compiled.segments) {
+		for (size_t i = 0; i < s.bytes.size(); ++i) {
+			int pos = s.pos + static_cast<int>(i);
+			int score = BytePattern::Commonness(s.bytes[i]);
+			if (best[0] < 0 || score < best_score[0]) {
+				best[1] = best[0];
+				best_score[1] = best_score[0];
+				best_byte[1] = best_byte[0];
+				best[0] = pos;
+				best_score[0] = score;
+				best_byte[0] = s.bytes[i];
+			}
+			else if (best[1] < 0 || score < best_score[1]) {
+				best[1] = pos;
+				best_score[1] = score;
+				best_byte[1] = s.bytes[i];
+			}
+		}
+	}
+	compiled.anchor_pos[0] = best[0];
+	compiled.anchor_byte[0] = best_byte[0];
+	compiled.anchor_pos[1] = best[1];
+	compiled.anchor_byte[1] = best_byte[1];
+}
+
+//Horspool on the longest literal run, candidates found there are verified against the whole pattern
+static void BuildSkipTable(Pattern& compiled) {
+	compiled.skip_segment = -1;
+	size_t longest = 0;
+	for (size_t i = 0; i < compiled.segments.size(); ++i) {
+		size_t len = compiled.segments[i].bytes.size();
+		if (len >= BytePattern::kMinSkipRun && len > longest) {
+			longest = len;
+			compiled.skip_segment = static_cast<int>(i);
+		}
+	}
+	if (compiled.skip_segment < 0) {
+		return;
+	}
+
+	const std::vector<uint8_t>& run = compiled.segments[compiled.skip_segment].bytes;
+	compiled.skip.assign(0x100, static_cast<uint32_t>(longest));
+	for (size_t i = 0; i + 1 < longest; ++i) {
+		compiled.skip[run[i]] = static_cast<uint32_t>(longest - 1 - i);
+	}
+}
+
+//how much a position narrows down the candidates, rare literals most, the default anchors are already known to match
+static int Selectivity(const Pattern& compiled, size_t pos) {
+	if (static_cast<int>(pos) == compiled.anchor_pos[0] || static_cast<int>(pos) == compiled.anchor_pos[1]) {
+		return 0;
+	}
+	uint8_t mask = compiled.mask[pos];
+	if (mask == 0xFF) {
+		return 16 - BytePattern::Commonness(compiled.value[pos]) / 4;
+	}
+	int bits = 0;
+	for (; mask; mask &= mask - 1) {
+		++bits;
+	}
+	return bits * 2;
+}
+
+//verification blocks ordered by selectivity so a candidate fails on the most discriminating block first
+static void BuildVerifyOrder(Pattern& compiled) {
+	auto order = [&compiled](size_t block, std::vector<uint32_t>& offsets) {
+		std::vector<std::pair<int, uint32_t>> scored;
+		for (size_t offset = 0; offset < compiled.mask.size(); offset += block) {
+			int score = 0;
+			for (size_t i = offset; i < offset + block && i < compiled.span; ++i) {
+				score += Selectivity(compiled, i);
+			}
+			scored.push_back(std::make_pair(score, static_cast<uint32_t>(offset)));
+		}
+		std::stable_sort(scored.begin(), scored.end(), [](const std::pair<int, uint32_t>& a, const std::pair<int, uint32_t>& b) {
+			return a.first > b.first;
+		});
+		offsets.clear();
+		for (auto& item : scored) {
+			offsets.push_back(item.second);
+		}
+	};
+	order(16, compiled.verify_sse2);
+	order(32, compiled.verify_avx2);
+}
+
+//B table of the bit-parallel kernels, bit i of entry b is set when b matches pattern position i
+static void BuildMatchTable(const Pattern& pattern, uint64_t *table) {
+	for (int byte = 0; byte < 0x100; ++byte) {
+		uint64_t bits = 0;
+		for (size_t i = 0; i < pattern.span; ++i) {
+			if ((byte & pattern.mask[i]) == pattern.value[i]) {
+				bits |= 1ULL << i;
+			}
+		}
+		table[byte] = bits;
+	}
+	for (auto& byte_class : pattern.classes) {
+		for (int byte = 0; byte < 0x100; ++byte) {
+			if (!(byte_class.bits[byte >> 5] & (1u << (byte & 31)))) {
+				table[byte] &= ~(1ULL << byte_class.pos);
+			}
+		}
+	}
+}
+
+static void BuildShiftAnd(Pattern& compiled) {
+	if (compiled.anchor_pos[0] >= 0 || compiled.span == 0 || compiled.span > 64) {
+		return;
+	}
+	compiled.shift_and.resize(0x100);
+	BuildMatchTable(compiled, &compiled.shift_and[0]);
+}
+
+static bool HasAVX2() {
+	static int avx2 = -1;
+	if (avx2 < 0) {
+		int info[4];
+		int result = 0;
+		__cpuid(info, 0);
+		if (info[0] >= 7) {
+			__cpuid(info, 1);
+			bool osxsave = (info[2] & (1 << 27)) != 0;
+			bool avx = (info[2] & (1 << 28)) != 0;
+			if (osxsave && avx && (_xgetbv(0) & 6) == 6) {
+				__cpuidex(info, 7, 0);
+				result = (info[1] & (1 << 5)) != 0;
+			}
+		}
+		avx2 = result;
+	}
+	return avx2 != 0;
+}
+
+static bool VerifyClasses(const Pattern& pattern, const uint8_t *pos) {
+	for (auto& byte_class : pattern.classes) {
+		uint8_t byte = pos[byte_class.pos];
+		if (!(byte_class.bits[byte >> 5] & (1u << (byte & 31)))) {
+			COUNT_STAT(rejected_classes);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool VerifyScalar(const Pattern& pattern, const uint8_t *pos) {
+	const uint8_t *mask = &pattern.mask[0];
+	const uint8_t *value = &pattern.value[0];
+	for (auto offset : pattern.verify_sse2) {
+		size_t last = std::min<size_t>(offset + 16, pattern.span);
+		for (size_t i = offset; i < last; ++i) {
+			if ((pos[i] & mask[i]) != value[i]) {
+				COUNT_REJECT(offset);
+				return false;
+			}
+		}
+	}
+	return pattern.classes.empty() || VerifyClasses(pattern, pos);
+}
+
+//checks the pattern at pos, end is the end of the readable range
+static bool VerifySSE2(const Pattern& pattern, const uint8_t *pos, const uint8_t *end) {
+	COUNT_STAT(candidates);
+	const uint8_t *mask = &pattern.mask[0];
+	const uint8_t *value = &pattern.value[0];
+	size_t padded = pattern.mask.size();
+	if (static_cast<size_t>(end - pos) < padded) {
+		return VerifyScalar(pattern, pos);
+	}
+
+	for (auto i : pattern.verify_sse2) {
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos + i));
+		__m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(value + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(data, m), v)) != 0xFFFF) {
+			COUNT_REJECT(i);
+			return false;
+		}
+	}
+	return pattern.classes.empty() || VerifyClasses(pattern, pos);
+}
 
-	size_t size = strlen(pattern);
-	Pattern& compiled = *dst;
+static bool VerifyAVX2(const Pattern& pattern, const uint8_t *pos, const uint8_t *end) {
+	COUNT_STAT(candidates);
+	const uint8_t *mask = &pattern.mask[0];
+	const uint8_t *value = &pattern.value[0];
+	size_t padded = pattern.mask.size();
+	if (static_cast<size_t>(end - pos) < padded) {
+		return VerifyScalar(pattern, pos);
+	}
+
+	for (auto i : pattern.verify_avx2) {
+		__m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos + i));
+		__m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(value + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(data, m), v)) != -1) {
+			COUNT_REJECT(i);
+			return false;
+		}
+	}
+	return pattern.classes.empty() || VerifyClasses(pattern, pos);
+}
+
+//the bytes a kernel compares before verifying, both are always set so the kernels never branch on them
+struct ScanAnchors {
+	int pos[2];
+	uint8_t byte[2];
+};
+
+static ScanAnchors DefaultAnchors(const Pattern& pattern) {
+	ScanAnchors anchors;
+	for (int i = 0; i < 2; ++i) {
+		int source = pattern.anchor_pos[i] < 0 ? 0 : i;
+		anchors.pos[i] = pattern.anchor_pos[source];
+		anchors.byte[i] = pattern.anchor_byte[source];
+	}
+	return anchors;
+}
+
+//picks the rarest adjacent literal pair of the scanned data, or the two rarest literal bytes when their
+//estimated joint count is lower (or the pattern has no adjacent literals)
+static ScanAnchors SelectAnchors(const Pattern& pattern, const ByteFrequency& frequency) {
+	ScanAnchors anchors = DefaultAnchors(pattern);
+	double best = -1;
+	int single[2] = { -1, -1 };
+	uint8_t single_byte[2] = { 0, 0 };
+	for (auto& s : pattern.segments) {
+		for (size_t i = 0; i < s.bytes.size(); ++i) {
+			int pos = s.pos + static_cast<int>(i);
+			uint8_t byte = s.bytes[i];
+			if (single[0] < 0 || frequency.bytes[byte] < frequency.bytes[single_byte[0]]) {
+				single[1] = single[0];
+				single_byte[1] = single_byte[0];
+				single[0] = pos;
+				single_byte[0] = byte;
+			}
+			else if (single[1] < 0 || frequency.bytes[byte] < frequency.bytes[single_byte[1]]) {
+				single[1] = pos;
+				single_byte[1] = byte;
+			}
 
-	auto hex2dec = [](char hex) -> uint8_t {
+			if (i + 1 < s.bytes.size()) {
+				double count = frequency.pairs[byte | (s.bytes[i + 1] << 8)];
+				if (best < 0 || count < best) {
+					best = count;
+					anchors.pos[0] = pos;
+					anchors.byte[0] = byte;
+					anchors.pos[1] = pos + 1;
+					anchors.byte[1] = s.bytes[i + 1];
+				}
+			}
+		}
+	}
+
+	if (single[1] >= 0 && frequency.total > 0) {
+		double joint = static_cast<double>(frequency.bytes[single_byte[0]]) * frequency.bytes[single_byte[1]] / frequency.total;
+		if (best < 0 || joint < best) {
+			anchors.pos[0] = single[0];
+			anchors.byte[0] = single_byte[0];
+			anchors.pos[1] = single[1];
+			anchors.byte[1] = single_byte[1];
+		}
+	}
+	return anchors;
+}
+
+//starts is the number of candidate start positions, every anchor load stays within the range
+static const uint8_t * ScanScalar(const Pattern& pattern, const ScanAnchors& anchors, const uint8_t *begin, size_t pos, size_t starts) {
+	const uint8_t *end = begin + starts + pattern.span - 1;
+	const uint8_t *a0 = begin + anchors.pos[0];
+	const uint8_t *a1 = begin + anchors.pos[1];
+	uint8_t b0 = anchors.byte[0], b1 = anchors.byte[1];
+	for (; pos < starts; ++pos) {
+		if (a0[pos] == b0 && a1[pos] == b1 && VerifySSE2(pattern, begin + pos, end)) {
+			return begin + pos;
+		}
+	}
+	return nullptr;
+}
+
+//patterns made of nibbles and wildcards only have no anchor to scan for
+static const uint8_t * ScanUnanchored(const Pattern& pattern, const uint8_t *begin, size_t starts) {
+	const uint8_t *end = begin + starts + pattern.span - 1;
+	for (size_t pos = 0; pos < starts; ++pos) {
+		if (VerifySSE2(pattern, begin + pos, end)) {
+			return begin + pos;
+		}
+	}
+	return nullptr;
+}
+
+static const uint8_t * ScanSSE2(const Pattern& pattern, const ScanAnchors& anchors, const uint8_t *begin, size_t starts) {
+	const uint8_t *end = begin + starts + pattern.span - 1;
+	const uint8_t *a0 = begin + anchors.pos[0];
+	const uint8_t *a1 = begin + anchors.pos[1];
+	const __m128i b0 = _mm_set1_epi8(static_cast<char>(anchors.byte[0]));
+	const __m128i b1 = _mm_set1_epi8(static_cast<char>(anchors.byte[1]));
+	size_t pos = 0;
+	for (; pos + 16 <= starts; pos += 16) {
+		__m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a0 + pos)), b0);
+		__m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a1 + pos)), b1);
+		unsigned long mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(eq0, eq1)));
+		while (mask) {
+			unsigned long bit;
+			_BitScanForward(&bit, mask);
+			if (VerifySSE2(pattern, begin + pos + bit, end)) {
+				return begin + pos + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+	return ScanScalar(pattern, anchors, begin, pos, starts);
+}
+
+static const uint8_t * ScanAVX2(const Pattern& pattern, const ScanAnchors& anchors, const uint8_t *begin, size_t starts) {
+	const uint8_t *end = begin + starts + pattern.span - 1;
+	const uint8_t *a0 = begin + anchors.pos[0];
+	const uint8_t *a1 = begin + anchors.pos[1];
+	const __m256i b0 = _mm256_set1_epi8(static_cast<char>(anchors.byte[0]));
+	const __m256i b1 = _mm256_set1_epi8(static_cast<char>(anchors.byte[1]));
+	const uint8_t *result = nullptr;
+	size_t pos = 0;
+	for (; !result && pos + 32 <= starts; pos += 32) {
+		__m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a0 + pos)), b0);
+		__m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a1 + pos)), b1);
+		unsigned long mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(eq0, eq1)));
+		while (mask) {
+			unsigned long bit;
+			_BitScanForward(&bit, mask);
+			if (VerifyAVX2(pattern, begin + pos + bit, end)) {
+				result = begin + pos + bit;
+				break;
+			}
+			mask &= mask - 1;
+		}
+	}
+	_mm256_zeroupper();
+	if (result) {
+		return result;
+	}
+	return ScanScalar(pattern, anchors, begin, pos, starts);
+}
+
+static const uint8_t * ScanHorspool(const Pattern& pattern, const uint8_t *begin, size_t starts) {
+	const uint8_t *end = begin + starts + pattern.span - 1;
+	const Segment& run = pattern.segments[pattern.skip_segment];
+	const uint8_t *needle = &run.bytes[0];
+	size_t last = run.bytes.size() - 1;
+	const uint8_t *text = begin + run.pos;
+	const uint32_t *skip = &pattern.skip[0];
+	for (size_t pos = 0; pos < starts;) {
+		uint8_t tail = text[pos + last];
+		if (tail == needle[last] && memcmp(text + pos, needle, last) == 0 && VerifySSE2(pattern, begin + pos, end)) {
+			return begin + pos;
+		}
+		pos += skip[tail];
+	}
+	return nullptr;
+}
+
+//Horspool only pays off when its average shift beats the stride of the vector anchor scan
+static bool UseHorspool(const Pattern& pattern) {
+	if (pattern.skip_segment < 0) {
+		return false;
+	}
+	size_t stride = HasAVX2() ? 32 : 16;
+	return pattern.segments[pattern.skip_segment].bytes.size() >= stride;
+}
+
+//bit-parallel NFA, one table lookup per byte whatever the number of alternatives
+static const uint8_t * ScanShiftAnd(const Pattern& pattern, const uint8_t *begin, size_t starts) {
+	const uint64_t *table = &pattern.shift_and[0];
+	const uint64_t found = 1ULL << (pattern.span - 1);
+	const size_t end = starts + pattern.span - 1;
+	uint64_t state = 0;
+	for (size_t pos = 0; pos < end; ++pos) {
+		state = ((state << 1) | 1) & table[begin[pos]];
+		if (state & found) {
+			return begin + pos + 1 - pattern.span;
+		}
+	}
+	return nullptr;
+}
+
+static const uint8_t * Scan(const Pattern& pattern, const ScanAnchors& anchors, const uint8_t *begin, size_t starts) {
+	if (pattern.anchor_pos[0] < 0) {
+		if (!pattern.shift_and.empty()) {
+			return ScanShiftAnd(pattern, begin, starts);
+		}
+		return ScanUnanchored(pattern, begin, starts);
+	}
+	if (UseHorspool(pattern)) {
+		return ScanHorspool(pattern, begin, starts);
+	}
+	if (HasAVX2()) {
+		return ScanAVX2(pattern, anchors, begin, starts);
+	}
+	return ScanSSE2(pattern, anchors, begin, starts);
+}
+
+static ScanAnchors ChooseScanAnchors(const Pattern& pattern, const ByteFrequency *frequency) {
+	if (frequency && pattern.anchor_pos[0] >= 0) {
+		return SelectAnchors(pattern, *frequency);
+	}
+	return DefaultAnchors(pattern);
+}
+
+struct CaptureType {
+	const char *name;
+	uint8_t size;
+	bool is_signed;
+};
+
+static const CaptureType kCaptureTypes[] = {
+	{ "i8", 1, true }, { "u8", 1, false }, { "i16", 2, true }, { "u16", 2, false },
+	{ "i32", 4, true }, { "u32", 4, false }, { "i64", 8, true }, { "u64", 8, false },
+};
+
+//"+N" / "-N" (decimal or 0x hex), "rel8" / "rel32" with an optional "@offset", "deref32", "deref64"
+static bool ParseOps(const char *pos, std::vector<PatternOp>& ops) {
+	while (*pos) {
+		if (isspace(static_cast<unsigned char>(*pos))) {
+			++pos;
+			continue;
+		}
+
+		const char *token = pos;
+		for (; *pos && !isspace(static_cast<unsigned char>(*pos)); ++pos);
+		std::string name(token, pos);
+		PatternOp op = { kOpAdd, 0 };
+		auto parse_number = [](const std::string& text, int64_t& number) -> bool {
+			if (text.empty()) {
+				return false;
+			}
+			char *end;
+			number = strtoll(text.c_str(), &end, 0);
+			return *end == '\0';
+		};
+
+		if (name[0] == '+' || name[0] == '-') {
+			if (name.size() < 2 || !isdigit(static_cast<unsigned char>(name[1])) || !parse_number(name, op.operand)) {
+				return false;
+			}
+		}
+		else if (name.compare(0, 3, "rel") == 0) {
+			size_t at = name.find('@');
+			std::string width = name.substr(0, at);
+			if (width == "rel8") {
+				op.type = kOpRel8;
+			}
+			else if (width == "rel32") {
+				op.type = kOpRel32;
+			}
+			else {
+				return false;
+			}
+			if (at != std::string::npos && (!parse_number(name.substr(at + 1), op.operand) || op.operand < 0)) {
+				return false;
+			}
+		}
+		else if (name == "deref32") {
+			op.type = kOpDeref32;
+		}
+		else if (name == "deref64") {
+			op.type = kOpDeref64;
+		}
+		else {
+			return false;
+		}
+		ops.push_back(op);
+	}
+	return true;
+}
+
+Pattern * BytePattern::CreatePattern(const char *pattern) {
+	auto hex2dec = [](char hex, uint8_t& nibble) -> bool {
 		if (hex >= '0' && hex <= '9') {
-			return hex - '0';
+			nibble = hex - '0';
 		}
 		else if (hex >= 'A' && hex <= 'F') {
-			return hex - 'A' + 0xA;
+			nibble = hex - 'A' + 0xA;
 		}
 		else if (hex >= 'a' && hex <= 'f') {
-			return hex - 'a' + 0xA;
+			nibble = hex - 'a' + 0xA;
 		}
 		else {
-			return 0; //invalid
+			return false;
 		}
+		return true;
 	};
 
-	Segment seg;
-	seg.pos = 0;
-	seg.bytes.reserve(kMaxBytes);
-	auto next = [&compiled, &seg](int pos) {
-		if (seg.bytes.size()) {
-			compiled.push_back(seg);
-			seg.bytes.clear();
+	//each nibble is a hex digit or '?', a lone '?' is a whole wildcard byte
+	std::vector<uint8_t> mask, value;
+	std::vector<Capture> captures;
+	std::vector<ByteClass> classes;
+	auto push = [&](char high, char low) -> bool {
+		uint8_t byte_mask = 0, byte_value = 0, nibble;
+		if (high != '?') {
+			if (!hex2dec(high, nibble)) {
+				return false;
+			}
+			byte_mask |= 0xF0;
+			byte_value |= nibble << 4;
 		}
-		seg.pos = pos;
+		if (low != '?') {
+			if (!hex2dec(low, nibble)) {
+				return false;
+			}
+			byte_mask |= 0x0F;
+			byte_value |= nibble;
+		}
+		mask.push_back(byte_mask);
+		value.push_back(byte_value);
+		return true;
 	};
 
-	auto push = [&seg](uint8_t byte) {
-		if (seg.bytes.size() < kMaxBytes) {
-			seg.bytes.push_back(byte);
+	//post-match operators follow "=>"
+	const char *arrow = strstr(pattern, "=>");
+	const char *bytes_end = arrow ? arrow : pattern + strlen(pattern);
+	std::vector<PatternOp> ops;
+	if (arrow && !ParseOps(arrow + 2, ops)) {
+		return nullptr;
+	}
+
+	for (const char *pos = pattern; pos < bytes_end;) {
+		if (isspace(static_cast<unsigned char>(*pos))) {
+			++pos;
+			continue;
 		}
-	};
 
-	for (size_t i = 0; i < size - 1; i += 3) {
-		uint8_t value;
-		if (pattern[i] == '?') {
-			next(i / 3 + 1);
+		const char *token = pos;
+		for (; pos < bytes_end && !isspace(static_cast<unsigned char>(*pos)); ++pos);
+		size_t len = pos - token;
+		if (token[0] == '[') {
+			if (len < 3 || token[len - 1] != ']') {
+				return nullptr;
+			}
+			std::string name(token + 1, len - 2);
+			bool known = false;
+			for (auto& type : kCaptureTypes) {
+				if (name == type.name) {
+					Capture capture = { static_cast<int>(mask.size()), type.size, type.is_signed };
+					captures.push_back(capture);
+					for (uint8_t i = 0; i < type.size; ++i) {
+						push('?', '?');
+					}
+					known = true;
+					break;
+				}
+			}
+			if (!known) {
+				return nullptr;
+			}
+			continue;
 		}
-		else {
-			value = hex2dec(pattern[i]) * 0x10 + hex2dec(pattern[i + 1]);
-			push(value);
+		if (len == 1 && token[0] == '?') {
+			push('?', '?');
+			continue;
 		}
+		if (std::find(token, pos, '|') != pos || std::find(token, pos, '-') != pos) {
+			ByteClass byte_class = { static_cast<int>(mask.size()), { 0 } };
+			for (const char *part = token; part < pos;) {
+				uint8_t digits[4];
+				size_t count = 0;
+				bool range = false;
+				for (; part < pos && *part != '|'; ++part) {
+					if (*part == '-' && count == 2 && !range) {
+						range = true;
+					}
+					else if (count == 4 || !hex2dec(*part, digits[count++])) {
+						return nullptr;
+					}
+				}
+				if (count != (range ? 4u : 2u)) {
+					return nullptr;
+				}
+				int low = digits[0] << 4 | digits[1];
+				int high = range ? digits[2] << 4 | digits[3] : low;
+				if (high < low) {
+					return nullptr;
+				}
+				for (int byte = low; byte <= high; ++byte) {
+					byte_class.bits[byte >> 5] |= 1u << (byte & 31);
+				}
+				if (part < pos && ++part == pos) {
+					return nullptr; //trailing '|'
+				}
+			}
+
+			//keep the bits every alternative shares in the mask/value, the class only when that is not exact
+			uint8_t all_ones = 0xFF, all_zeros = 0xFF;
+			int members = 0;
+			for (int byte = 0; byte < 0x100; ++byte) {
+				if (byte_class.bits[byte >> 5] & (1u << (byte & 31))) {
+					all_ones &= byte;
+					all_zeros &= ~byte;
+					++members;
+				}
+			}
+			uint8_t byte_mask = all_ones | all_zeros;
+			int free_bits = 0;
+			for (int bit = 0; bit < 8; ++bit) {
+				free_bits += (byte_mask >> bit & 1) ? 0 : 1;
+			}
+			mask.push_back(byte_mask);
+			value.push_back(all_ones);
+			if (members != 1 << free_bits) {
+				classes.push_back(byte_class);
+			}
+			continue;
+		}
+		if (len % 2 != 0) {
+			return nullptr;
+		}
+		for (size_t i = 0; i < len; i += 2) {
+			if (!push(token[i], token[i + 1])) {
+				return nullptr;
+			}
+		}
+	}
+
+	size_t span = mask.size();
+	while (span > 0 && mask[span - 1] == 0) {
+		--span;
+	}
+	//trailing captures and classes still have to be inside the matched range
+	for (auto& capture : captures) {
+		span = std::max(span, static_cast<size_t>(capture.pos + capture.size));
 	}
-	next(0);
+	for (auto& byte_class : classes) {
+		span = std::max(span, static_cast<size_t>(byte_class.pos + 1));
+	}
+
+	Pattern *dst = CreatePattern(mask.empty() ? nullptr : &mask[0], value.empty() ? nullptr : &value[0], span, classes.empty() ? nullptr : &classes[0], classes.size());
+	dst->captures = captures;
+	dst->ops = ops;
+	return dst;
+}
 
+Pattern * BytePattern::CreatePattern(const uint8_t *mask, const uint8_t *value, size_t span, const ByteClass *classes, size_t class_count) {
+	Pattern *dst = new Pattern();
+	CompilePattern(dst, mask, value, span, classes, class_count);
 	return dst;
 }
 
+void BytePattern::CompilePattern(Pattern *pattern, const uint8_t *mask, const uint8_t *value, size_t span, const ByteClass *classes, size_t class_count) {
+	Pattern& compiled = *pattern;
+
+	compiled.span = span;
+	compiled.classes.assign(classes, classes + class_count);
+	compiled.captures.clear();
+	compiled.ops.clear();
+	compiled.shift_and.clear();
+
+	size_t padded = (compiled.span + kMaskAlign - 1) / kMaskAlign * kMaskAlign;
+	compiled.mask.assign(mask, mask + compiled.span);
+	compiled.value.assign(value, value + compiled.span);
+	compiled.mask.resize(padded, 0);
+	compiled.value.resize(padded, 0);
+
+	//segment entries of an earlier compile are refilled so their byte storage is reused
+	size_t segment_count = 0;
+	for (size_t i = 0; i < compiled.span;) {
+		if (mask[i] != 0xFF) {
+			++i;
+			continue;
+		}
+		if (segment_count == compiled.segments.size()) {
+			compiled.segments.push_back(Segment());
+		}
+		Segment& seg = compiled.segments[segment_count++];
+		seg.pos = static_cast<int>(i);
+		size_t end = i;
+		for (; end < compiled.span && mask[end] == 0xFF; ++end);
+		seg.bytes.assign(value + i, value + end);
+		i = end;
+	}
+	compiled.segments.resize(segment_count);
+	ChooseAnchors(compiled);
+	BuildSkipTable(compiled);
+	BuildVerifyOrder(compiled);
+	BuildShiftAnd(compiled);
+}
+
 void BytePattern::DestroyPattern(Pattern *pattern) {
 	delete pattern;
 }
 
-const void * BytePattern::Find(Pattern *pattern, const void *range_begin, size_t size) {
+const ScanStats& BytePattern::stats() {
+#ifdef BYTE_PATTERN_STATS
+	return Stats;
+#else
+	static const ScanStats empty = {};
+	return empty;
+#endif
+}
+
+void BytePattern::ResetStats() {
+#ifdef BYTE_PATTERN_STATS
+	memset(&Stats, 0, sizeof(Stats));
+#endif
+}
+
+void BytePattern::ComputeFrequency(const void *range_begin, size_t size, ByteFrequency& frequency) {
+	memset(&frequency, 0, sizeof(frequency));
+	const uint8_t *begin = reinterpret_cast<const uint8_t *>(range_begin);
+	frequency.total = static_cast<uint32_t>(size);
+	if (size == 0) {
+		return;
+	}
+	for (size_t i = 0; i + 1 < size; ++i) {
+		++frequency.bytes[begin[i]];
+		++frequency.pairs[begin[i] | (begin[i + 1] << 8)];
+	}
+	++frequency.bytes[begin[size - 1]];
+}
+
+const void * BytePattern::Find(Pattern *pattern, const void *range_begin, size_t size, const ByteFrequency *frequency) {
 	if (!pattern) {
 		return nullptr;
 	}
 
-	if (pattern->size() == 0) {
+	if (pattern->span == 0 || pattern->span > size) {
 		return nullptr;
 	}
 
-	const void *result = nullptr;
 	const uint8_t *begin = reinterpret_cast<const uint8_t *>(range_begin);
-	int range_pos = 0;
-	for (size_t seg = 0; seg < pattern->size(); ) {
-		Segment& s = pattern->at(seg);
-		size_t seg_size = s.bytes.size();
-		if (range_pos + s.pos + seg_size >= size) {
-			break; //not found
-		}
-		
-		if (memcmp(&s.bytes[0], begin + range_pos + s.pos, seg_size) == 0) {
-			if (seg < pattern->size() - 1) {
-				++seg;
-			}
-			else {
-				result = begin + range_pos;
-				break; //found all segments
-			}
+	return Scan(*pattern, ChooseScanAnchors(*pattern, frequency), begin, size - pattern->span + 1);
+}
+
+size_t BytePattern::FindAll(Pattern *pattern, const void *range_begin, size_t size, const std::function<bool(const void *)>& visit, size_t max_hits, const ByteFrequency *frequency) {
+	if (!pattern) {
+		return 0;
+	}
+
+	if (pattern->span == 0 || pattern->span > size) {
+		return 0;
+	}
+
+	const uint8_t *begin = reinterpret_cast<const uint8_t *>(range_begin);
+	ScanAnchors anchors = ChooseScanAnchors(*pattern, frequency);
+	size_t starts = size - pattern->span + 1;
+	size_t hits = 0;
+	for (size_t pos = 0; pos < starts;) {
+		const uint8_t *hit = Scan(*pattern, anchors, begin + pos, starts - pos);
+		if (!hit) {
+			break;
 		}
-		else {
-			++range_pos;
-			seg = 0;
+		++hits;
+		if (!visit(hit) || hits == max_hits) {
+			break;
 		}
+		pos = hit - begin + 1;
 	}
-	return result;
+	return hits;
 }
 
 bool BytePattern::Match(Pattern *pattern, const void *range_begin, size_t size) {
 	if (!pattern) {
-		return nullptr;
+		return false;
 	}
 
-	if (pattern->size() == 0) {
-		return nullptr;
+	if (pattern->span == 0 || pattern->span > size) {
+		return false;
 	}
 
 	const uint8_t *begin = reinterpret_cast<const uint8_t *>(range_begin);
-	bool mismatch = false;
-	int range_pos = 0;
-	for (size_t seg = 0; seg < pattern->size();) {
-		Segment& s = pattern->at(seg);
-		size_t seg_size = s.bytes.size();
-		if (range_pos + s.pos + seg_size >= size) {
-			mismatch = true;
-			break; //not found
+	return VerifySSE2(*pattern, begin, begin + size);
+}
+
+void BytePattern::FindFuzzy(Pattern *pattern, const void *range_begin, size_t size, int max_mismatches, std::vector<FuzzyMatch>& matches, size_t limit) {
+	matches.clear();
+	if (!pattern || pattern->span == 0 || pattern->span > size || max_mismatches < 0) {
+		return;
+	}
+
+	//with a limit matches is a max-heap of the best ones so far, positions only grow so a later match displaces
+	//the worst one only with fewer mismatches, which also bounds the mismatches still worth finding
+	auto worse = [](const FuzzyMatch& a, const FuzzyMatch& b) {
+		return a.mismatches < b.mismatches || (a.mismatches == b.mismatches && a.pos < b.pos);
+	};
+	int allowed = max_mismatches;
+	auto add = [&](const void *pos, int mismatches) {
+		FuzzyMatch match = { pos, mismatches };
+		if (!limit) {
+			matches.push_back(match);
+			return;
+		}
+		if (matches.size() == limit) {
+			std::pop_heap(matches.begin(), matches.end(), worse);
+			matches.pop_back();
+		}
+		matches.push_back(match);
+		std::push_heap(matches.begin(), matches.end(), worse);
+		if (matches.size() == limit) {
+			allowed = matches.front().mismatches - 1;
+		}
+	};
+
+	const uint8_t *begin = reinterpret_cast<const uint8_t *>(range_begin);
+	const size_t span = pattern->span;
+	if (span <= 64) {
+		//Wu-Manber with substitutions only, state j holds the prefixes matched with at most j mismatches
+		uint64_t table[0x100];
+		BuildMatchTable(*pattern, table);
+		std::vector<uint64_t> states(max_mismatches + 1, 0);
+		const uint64_t found = 1ULL << (span - 1);
+		for (size_t pos = 0; pos < size && allowed >= 0; ++pos) {
+			uint64_t bits = table[begin[pos]];
+			uint64_t previous = states[0];
+			states[0] = ((states[0] << 1) | 1) & bits;
+			for (int j = 1; j <= max_mismatches; ++j) {
+				uint64_t current = states[j];
+				states[j] = (((current << 1) | 1) & bits) | ((previous << 1) | 1);
+				previous = current;
+			}
+			for (int j = 0; j <= allowed; ++j) {
+				if (states[j] & found) {
+					add(begin + pos + 1 - span, j);
+					break;
+				}
+			}
 		}
+	}
+	else {
+		//longer patterns count mismatches per start and give up once there are too many
+		std::vector<size_t> checked;
+		for (size_t i = 0; i < span; ++i) {
+			if (pattern->mask[i]) {
+				checked.push_back(i);
+			}
+		}
+		std::vector<int> classes(span, -1);
+		for (size_t i = 0; i < pattern->classes.size(); ++i) {
+			int pos = pattern->classes[i].pos;
+			if (!pattern->mask[pos]) {
+				checked.push_back(pos);
+			}
+			classes[pos] = static_cast<int>(i);
+		}
+		for (size_t start = 0; start + span <= size && allowed >= 0; ++start) {
+			const uint8_t *at = begin + start;
+			int mismatches = 0;
+			for (size_t i = 0; i < checked.size() && mismatches <= allowed; ++i) {
+				size_t pos = checked[i];
+				uint8_t byte = at[pos];
+				bool ok = (byte & pattern->mask[pos]) == pattern->value[pos];
+				if (ok && classes[pos] >= 0) {
+					ok = (pattern->classes[classes[pos]].bits[byte >> 5] & (1u << (byte & 31))) != 0;
+				}
+				mismatches += ok ? 0 : 1;
+			}
+			if (mismatches <= allowed) {
+				add(at, mismatches);
+			}
+		}
+	}
 
-		if (memcmp(&s.bytes[0], begin + range_pos + s.pos, seg_size) == 0) {
-			if (seg < pattern->size() - 1) {
-				++seg;
+	std::sort(matches.begin(), matches.end(), worse);
+}
+
+bool BytePattern::Resolve(Pattern *pattern, uint64_t address, uint64_t base, const std::function<bool(uint64_t, void *, size_t)>& read, uint64_t& result) {
+	for (auto& op : pattern->ops) {
+		switch (op.type) {
+		case kOpAdd:
+			address += op.operand;
+			break;
+		case kOpRel8: {
+			int8_t disp;
+			if (!read(address + op.operand, &disp, sizeof(disp))) {
+				return false;
 			}
-			else {
-				break; //found all segments
+			address += op.operand + sizeof(disp) + disp;
+			break;
+		}
+		case kOpRel32: {
+			int32_t disp;
+			if (!read(address + op.operand, &disp, sizeof(disp))) {
+				return false;
 			}
+			address += op.operand + sizeof(disp) + disp;
+			break;
 		}
-		else {
-			mismatch = true;
+		case kOpDeref32:
+		case kOpDeref64: {
+			uint64_t pointer = 0;
+			if (!read(address, &pointer, op.type == kOpDeref32 ? 4 : 8) || pointer < base) {
+				return false;
+			}
+			address = pointer - base;
 			break;
 		}
+		}
 	}
-	return !mismatch;
-}
\ No newline at end of file
+	result = address;
+	return true;
+}
+
+int64_t BytePattern::DecodeCapture(const Capture& capture, const void *match) {
+	const uint8_t *bytes = reinterpret_cast<const uint8_t *>(match) + capture.pos;
+	uint64_t value = 0;
+	for (int i = capture.size - 1; i >= 0; --i) {
+		value = value << 8 | bytes[i];
+	}
+	if (capture.is_signed && capture.size < 8) {
+		uint64_t sign = 1ULL << (capture.size * 8 - 1);
+		value = (value ^ sign) - sign;
+	}
+	return static_cast<int64_t>(value);
+}
@@ -1,16 +1,113 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
+#include <functional>
 
-struct Segment;
-typedef std::vector<Segment> Pattern;
+struct Segment {
+	int pos;
+	std::vector<uint8_t> bytes;
+};
+
+//a "[i32]" style token, matches any bytes and decodes them little endian from each match
+struct Capture {
+	int pos;
+	uint8_t size; //1, 2, 4 or 8
+	bool is_signed;
+};
+
+//byte alternatives at one position ("E8|E9", "50-57", "74|75|EB"), checked after the position's mask/value
+//which holds the bits all alternatives share, classes that the mask/value expresses exactly are not kept
+struct ByteClass {
+	int pos;
+	uint32_t bits[8];
+};
+
+enum PatternOpType {
+	kOpAdd, //address += operand
+	kOpRel8, //address = end of the rel8 displacement at address + operand, plus the displacement
+	kOpRel32,
+	kOpDeref32, //address = pointer read at address, rebased from absolute to the address space
+	kOpDeref64,
+};
+
+struct PatternOp {
+	PatternOpType type;
+	int64_t operand;
+};
+
+//patterns compile to a mask/value pair per byte, a byte matches when (byte & mask) == value,
+//segments list the runs of fully specified bytes
+struct Pattern {
+	std::vector<uint8_t> mask; //padded with zero mask bytes to a multiple of kMaskAlign
+	std::vector<uint8_t> value;
+	std::vector<Segment> segments;
+	size_t span; //from pattern start to the last byte that is not a full wildcard
+	int anchor_pos[2]; //pattern offsets of the scan anchors, -1 if unused
+	uint8_t anchor_byte[2];
+	int skip_segment; //longest segment when it is long enough for Horspool skipping, -1 otherwise
+	std::vector<uint32_t> skip; //bad character shifts for skip_segment
+	std::vector<Capture> captures; //in pattern order
+	std::vector<PatternOp> ops; //post-match operators, applied in order to the match address
+	std::vector<ByteClass> classes;
+	std::vector<uint32_t> verify_sse2; //offsets of the 16 byte verification blocks, most selective first
+	std::vector<uint32_t> verify_avx2; //same for 32 byte blocks
+	std::vector<uint64_t> shift_and; //bit i of entry b is set when b matches position i, built for unanchored patterns up to 64 bytes
+};
+
+//byte and byte pair counts of the data being scanned, pairs are indexed by first | second << 8
+struct ByteFrequency {
+	uint32_t total;
+	uint32_t bytes[0x100];
+	uint32_t pairs[0x10000];
+};
+
+//collected only in builds defining BYTE_PATTERN_STATS (the benchmark), single threaded use only
+struct ScanStats {
+	static const size_t kBlocks = 8;
+
+	uint64_t candidates; //positions whose anchors matched and that went through verification
+	uint64_t rejected[kBlocks]; //candidates failing the verification block at pattern offset 16 * i, the last entry also counts later blocks
+	uint64_t rejected_classes; //candidates failing only on a byte class
+};
+
+struct FuzzyMatch {
+	const void *pos;
+	int mismatches;
+};
 
 class BytePattern {
 public:
-	static const int kMaxBytes = 256;
+	static const size_t kMaskAlign = 32;
+	static const size_t kMinSkipRun = 16;
+
+	static int Commonness(uint8_t byte);
 
+	//accepts hex bytes with '?' for any nibble ("4? 8B ?5 ??"), byte alternatives and ranges ("E8|E9", "50-57|5F"), captures [i8] [u8] [i16] [u16] [i32] [u32] [i64] [u64],
+	//(lua receives [i64] [u64] as exact hex strings), optionally followed by post-match operators ("E8 ?? ?? ?? ?? => rel32@1 +8 deref32"), returns nullptr for a malformed pattern
 	static Pattern * CreatePattern(const char *pattern);
+	//builds a pattern from already compiled mask/value bytes (span of each) and classes, no text is parsed,
+	//captures and post-match operators are left to the caller
+	static Pattern * CreatePattern(const uint8_t *mask, const uint8_t *value, size_t span, const ByteClass *classes, size_t class_count);
+	//same, rebuilding an existing pattern in place so callers compiling many patterns in a row reuse its storage
+	static void CompilePattern(Pattern *pattern, const uint8_t *mask, const uint8_t *value, size_t span, const ByteClass *classes, size_t class_count);
 	static void DestroyPattern(Pattern *pattern);
-	static const void * Find(Pattern *pattern, const void *range_begin, size_t size);
+	static const ScanStats& stats();
+	static void ResetStats();
+
+	static void ComputeFrequency(const void *range_begin, size_t size, ByteFrequency& frequency);
+
+	//with a frequency table the scan anchors are the rarest literal bytes of that data instead of the compiled defaults
+	static const void * Find(Pattern *pattern, const void *range_begin, size_t size, const ByteFrequency *frequency = nullptr);
+	//calls visit for every match in order until it returns false or max_hits (0 = unlimited) is reached, returns the number of matches visited
+	static size_t FindAll(Pattern *pattern, const void *range_begin, size_t size, const std::function<bool(const void *)>& visit, size_t max_hits = 0, const ByteFrequency *frequency = nullptr);
 	static bool Match(Pattern *pattern, const void *buffer, size_t size);
+	//positions where at most max_mismatches non-wildcard bytes differ, fewest mismatches first and then by position,
+	//only the best limit (0 = unlimited) are kept while scanning, which stops once they all match exactly
+	static void FindFuzzy(Pattern *pattern, const void *range_begin, size_t size, int max_mismatches, std::vector<FuzzyMatch>& matches, size_t limit = 0);
+	//applies the post-match operators to a match address, read fetches bytes at an address of the same space
+	//and base is subtracted from dereferenced pointers, fails when a read fails
+	static bool Resolve(Pattern *pattern, uint64_t address, uint64_t base, const std::function<bool(uint64_t, void *, size_t)>& read, uint64_t& result);
+	//value of a capture in a match, sign or zero extended
+	static int64_t DecodeCapture(const Capture& capture, const void *match);
 };
@@ -1,19 +1,22 @@
 #include "BytePatternGen.h"
+#include "ParallelScan.h"
+#include "PEImage.h"
 
 #include <beaengine\BeaEngine.h>
 #include <vector>
 #include <string>
 #include <exception>
-#include <cassert>
-#include <list>
 #include <algorithm>
 
-static const int kMaxInstructions = 20;
+static const int kMaxInstructions = BytePatternSignature::kMaxInstructions;
+static const UInt32 kTailSize = 32; //more than the longest instruction
 
-static size_t to_string(size_t len, DISASM & dasm, char *dst) {
-	size_t pos, write_pos = 0;;
-	char hex_map[] = "0123456789ABCDEF";
-	std::list<std::pair<size_t, size_t>> replaces;
+//bit i is set when byte i of the instruction at dasm.EIP is left out of the signature
+typedef std::function<uint32_t(DISASM& dasm, size_t len)> WildcardRule;
+
+//guesses the operand bytes from the decoded operand values, for code without relocation information
+static uint32_t GuessWildcards(DISASM & dasm, size_t len) {
+	uint32_t wildcards = 0;
 
 	auto get_size = [](Int64 value) -> size_t {
 		size_t size = 0;
@@ -24,25 +27,22 @@ static size_t to_string(size_t len, DISASM & dasm, char *dst) {
 		return size;
 	};
 
-	auto find_replace_range = [len, &dasm, get_size](Int64 value) -> std::pair < size_t, size_t > {
+	//sets the bits of the first copy of value inside the instruction after the opcode
+	auto mark_value = [len, &dasm, &wildcards, get_size](Int64 value) {
 		auto opcode = dasm.Instruction.Opcode;
 		size_t op_size = opcode < 0xFF ? 1 : opcode < 0xFFFF ? 2 : 3;
 		size_t size = get_size(value);
 		uint8_t *target = reinterpret_cast<uint8_t *>(&value); //little-endian
-		auto ptr = reinterpret_cast<uint8_t *>(dasm.EIP);
-		auto orig_ptr = ptr;
-		for (ptr = ptr + op_size; ptr < ptr + len - size; ++ptr) {
+		auto orig_ptr = reinterpret_cast<uint8_t *>(dasm.EIP);
+		if (size == 0) {
+			return;
+		}
+		for (auto ptr = orig_ptr + op_size; ptr + size <= orig_ptr + len; ++ptr) {
 			if (memcmp(ptr, target, size) == 0) {
-				return std::pair<size_t, size_t>(ptr - orig_ptr, size);
+				wildcards |= ((1u << size) - 1) << (ptr - orig_ptr);
+				return;
 			}
 		}
-		return std::make_pair<size_t, size_t>(0, 0);
-	};
-
-	auto is_in_replace_range = [&replaces](size_t pos) -> bool {
-		return std::find_if(replaces.begin(), replaces.end(), [pos](std::pair<size_t, size_t>& pair) {
-			return pair.first <= pos && pos < pair.first + pair.second;
-		}) != replaces.end();
 	};
 
 	/*
@@ -56,24 +56,15 @@ static size_t to_string(size_t len, DISASM & dasm, char *dst) {
 	auto mark_ranges = [&](decltype(dasm.Argument1)& arg) {
 		if (arg.ArgType == MEMORY_TYPE) {
 			if (arg.Memory.Displacement) {
-				auto range = find_replace_range(arg.Memory.Displacement);
-				if (range.second > 0) {
-					replaces.push_back(range);
-				}
+				mark_value(arg.Memory.Displacement);
 			}
 
 			if (arg.Memory.IndexRegister) {
-				auto range = find_replace_range(arg.Memory.IndexRegister);
-				if (range.second > 0) {
-					replaces.push_back(range);
-				}
+				mark_value(arg.Memory.IndexRegister);
 			}
 		}
 		else if (arg.ArgType == CONSTANT_TYPE + RELATIVE_ || arg.ArgType == CONSTANT_TYPE + ABSOLUTE_){
-			auto range = find_replace_range(dasm.Instruction.Immediat);
-			if (range.second > 0) {
-				replaces.push_back(range);
-			}
+			mark_value(dasm.Instruction.Immediat);
 		}
 	};
 
@@ -81,7 +72,7 @@ static size_t to_string(size_t len, DISASM & dasm, char *dst) {
 		auto opcode = dasm.Instruction.Opcode;
 		size_t op_size = opcode < 0xFF ? 1 : opcode < 0xFFFF ? 2 : 3;
 		if (len > op_size) {
-			replaces.push_back(std::pair<size_t, size_t>(op_size, len - op_size));
+			wildcards |= ((1u << (len - op_size)) - 1) << op_size;
 		}
 	}
 	else {
@@ -101,80 +92,334 @@ static size_t to_string(size_t len, DISASM & dasm, char *dst) {
 		}
 	}
 
-	for (pos = 0, write_pos = 0; pos < len; ++pos) {
-		auto byte = reinterpret_cast<uint8_t *>(dasm.EIP)[pos];
-		if (is_in_replace_range(pos)) {
-			dst[write_pos++] = '?';
-			dst[write_pos++] = '?';
-		}
-		else {
-			dst[write_pos++] = hex_map[byte / 0x10];
-			dst[write_pos++] = hex_map[byte % 0x10];
-		}
-		dst[write_pos++] = ' ';
+	return wildcards;
+}
+
+//disassembles at dasm.EIP within what is left of the block, 0 when no whole instruction fits
+static int DisasmInBlock(DISASM& dasm) {
+	if (dasm.SecurityBlock == 0) {
+		return 0; //BeaEngine would take a zero block as unbounded
 	}
+	int len;
+	if (dasm.SecurityBlock >= kTailSize) {
+		len = Disasm(&dasm);
+	}
+	else {
+		//BeaEngine reads whole operands before it checks the block, the last bytes are decoded from a padded copy
+		uint8_t tail[kTailSize * 2] = { 0 };
+		memcpy(tail, reinterpret_cast<const void *>(dasm.EIP), dasm.SecurityBlock);
+		UIntPtr eip = dasm.EIP;
+		UInt64 virtual_addr = dasm.VirtualAddr;
+		dasm.EIP = (UIntPtr)tail;
+		dasm.VirtualAddr = virtual_addr ? virtual_addr : eip;
+		len = Disasm(&dasm);
+		dasm.EIP = eip;
+		dasm.VirtualAddr = virtual_addr;
+	}
+	return len > 0 && static_cast<UInt32>(len) <= dasm.SecurityBlock ? len : 0;
+}
 
-	assert(pos == len);
-	return write_pos;
+//moves past an instruction, shrinking the block so it keeps ending at the same byte
+static void Advance(DISASM& dasm, int len) {
+	dasm.EIP = dasm.EIP + (UIntPtr)len;
+	dasm.SecurityBlock -= len;
+	if (dasm.VirtualAddr) {
+		dasm.VirtualAddr = dasm.VirtualAddr + len;
+	}
 }
 
-const std::string BytePatternGen(uint8_t *start, uint8_t *max) {
-	std::string rv;
-	std::vector<char> buffer(128);
+//appends the instruction at dasm.EIP to the signature and advances past it, returns false at the first
+//instruction that cannot be disassembled or is int3 padding
+static bool AppendInstruction(DISASM& dasm, const WildcardRule& rule, BytePatternSignature& signature) {
+	int len = DisasmInBlock(dasm);
+	if (len == 0 || dasm.Instruction.Opcode == 0xCC || signature.size + len > BytePatternSignature::kMaxBytes) {
+		return false;
+	}
 
-	DISASM dasm;
-	memset(&dasm, 0, sizeof(DISASM));
+	uint32_t wildcards = rule(dasm, len);
+	auto bytes = reinterpret_cast<const uint8_t *>(dasm.EIP);
+	for (int pos = 0; pos < len; ++pos) {
+		bool wildcard = (wildcards & (1u << pos)) != 0;
+		signature.mask[signature.size] = wildcard ? 0 : 0xFF;
+		signature.value[signature.size] = wildcard ? 0 : bytes[pos];
+		++signature.size;
+	}
 
-	int len, i = 0, op_len;
-	int err = 0;
+	Advance(dasm, len);
+	return true;
+}
 
-	dasm.SecurityBlock = max - start;
+static void InitDisasm(DISASM& dasm, uint8_t *start, uint8_t *max) {
+	memset(&dasm, 0, sizeof(DISASM));
+	dasm.SecurityBlock = max > start ? static_cast<UInt32>(max - start) : 0;
 	dasm.EIP = (UIntPtr)start;
+}
 
-	while ((!err) && i < kMaxInstructions) {
-		len = Disasm(&dasm);
-		int opcode = dasm.Instruction.Opcode;
-		if (len != UNKNOWN_OPCODE && dasm.Instruction.Opcode != 0xCC) {
-			if (len <= 0) {
-				err = 1;
-				break;
-			}
-
-			op_len = opcode <= 0xFF ? 1 : opcode <= 0xFFFF ? 2 : 3;
+//appends the next instruction to the signature, false when there is none, optionally with the reason in error
+typedef std::function<bool(BytePatternSignature& signature, const char *& error)> AppendStep;
 
-			size_t strLen = len * 3 - 1;
-			char *buff;
-			if (dasm.Instruction.BranchType) {
-				/*
-				printf("[0x%llX] %s\n",
-				dasm.Instruction.AddrValue,
-				dasm.CompleteInstr);
-				*/
+//plain signatures stop at the instruction limit, with count they grow until unique and then by margin more instructions
+static bool Generate(const AppendStep& append, const std::function<size_t(Pattern *)>& count, int margin, BytePatternSignature& signature, const char *& error) {
+	signature.size = 0;
+	error = nullptr;
+	Pattern compiled = Pattern(); //every prefix is compiled into the same pattern
+	for (int i = 0; i < kMaxInstructions; ++i) {
+		if (!append(signature, error)) {
+			if (i == 0) {
+				if (!error) {
+					error = "cannot disassemble the first instruction";
+				}
+				return false;
+			}
+			if (!count) {
+				error = nullptr;
+				return true;
 			}
-			int buff_pos;
-			if (strLen > buffer.size()) {
-				buffer.resize(strLen);
+			if (!error) {
+				error = "instructions ended before the signature became unique";
 			}
-			buff = &buffer[0];
+			return false;
+		}
+		if (!count) {
+			continue;
+		}
+
+		size_t span = signature.size;
+		for (; span > 0 && signature.mask[span - 1] == 0; --span);
+		if (span == 0) {
+			continue; //nothing but wildcards yet
+		}
+		BytePattern::CompilePattern(&compiled, signature.mask, signature.value, span, nullptr, 0);
+		size_t matches = count(&compiled);
+		if (matches == 0) {
+			error = "signature does not match the target";
+			return false;
+		}
+		if (matches == 1) {
+			//extra instructions keep the signature unique after small changes around it
+			for (int extra = 0; extra < margin && append(signature, error); ++extra);
+			error = nullptr;
+			return true;
+		}
+	}
+	if (!count) {
+		return true;
+	}
+	error = "signature is not unique within the instruction limit";
+	return false;
+}
 
-			buff_pos = to_string(len, dasm, buff);
-			buff[buff_pos - 1] = '\0';
+static bool Generate(DISASM& dasm, const WildcardRule& rule, const std::function<size_t(Pattern *)>& count, int margin, BytePatternSignature& signature, const char *& error) {
+	return Generate([&](BytePatternSignature& signature, const char *&) {
+		return AppendInstruction(dasm, rule, signature);
+	}, count, margin, signature, error);
+}
+
+//the text api renders whatever was generated, error is left empty on success
+static bool Render(bool ok, const BytePatternSignature& signature, const char *error, std::string& pattern, std::string& error_text) {
+	BytePatternGenRender(signature, pattern);
+	error_text = error ? error : "";
+	return ok;
+}
 
-			if (rv.length()) {
-				rv.append(" ");
+//relocated bytes, and for direct branches the trailing displacement, which is the widest suffix decoding to the target
+static uint32_t ImageWildcards(PEImage *image, DISASM& dasm, size_t len) {
+	uint32_t wildcards = 0;
+	uint32_t at = static_cast<uint32_t>(dasm.VirtualAddr - image->image_base());
+	for (size_t pos = 0; pos < len; ++pos) {
+		if (image->IsRelocated(at + static_cast<uint32_t>(pos))) {
+			wildcards |= 1u << pos;
+		}
+	}
+	if (dasm.Instruction.BranchType && dasm.Instruction.AddrValue) {
+		auto bytes = reinterpret_cast<const uint8_t *>(dasm.EIP);
+		int64_t displacement = static_cast<int64_t>(dasm.Instruction.AddrValue - (dasm.VirtualAddr + len));
+		static const size_t kWidths[] = { 4, 2, 1 };
+		for (size_t width : kWidths) {
+			if (len <= width) {
+				continue;
+			}
+			int64_t value = 0;
+			memcpy(&value, bytes + len - width, width);
+			int shift = 64 - static_cast<int>(width) * 8;
+			if ((static_cast<int64_t>(static_cast<uint64_t>(value) << shift) >> shift) == displacement) {
+				wildcards |= ((1u << width) - 1) << (len - width);
+				break;
 			}
-			rv.append(buff);
+		}
+	}
+	return wildcards;
+}
 
-			//printf("%08X %s\n", dasm.EIP, dasm.CompleteInstr);
-			//printf("==> %s\n", buff);
+//the image is read in place, so the disassembly addresses are the preferred ones and not where the file is mapped
+static bool InitImageDisasm(DISASM& dasm, PEImage *image, uint32_t rva) {
+	auto ranges = image->FindSectionRanges(nullptr, 0, rva, 0xFFFFFFFF);
+	if (ranges.empty() || ranges[0].rva != rva) {
+		return false;
+	}
+	//the block ends with the section's data in the file and shrinks as the generator advances
+	uint8_t *start = const_cast<uint8_t *>(image->data()) + ranges[0].offset;
+	InitDisasm(dasm, start, start + ranges[0].size);
+	dasm.VirtualAddr = static_cast<UInt64>(image->image_base()) + rva;
+	return true;
+}
 
-			dasm.EIP = dasm.EIP + (UIntPtr)len;
-			i++;
+void BytePatternGenRender(const BytePatternSignature& signature, std::string& pattern) {
+	static const char hex_map[] = "0123456789ABCDEF";
+	pattern.clear();
+	pattern.reserve(signature.size * 3);
+	for (size_t pos = 0; pos < signature.size; ++pos) {
+		if (pos) {
+			pattern.push_back(' ');
+		}
+		if (signature.mask[pos] == 0) {
+			pattern.append("??");
 		}
 		else {
-			err = 1;
+			pattern.push_back(hex_map[signature.value[pos] / 0x10]);
+			pattern.push_back(hex_map[signature.value[pos] % 0x10]);
 		}
 	}
+}
+
+bool BytePatternGenSignature(uint8_t *start, uint8_t *max, const std::function<size_t(Pattern *)>& count, int margin, BytePatternSignature& signature, const char *& error) {
+	DISASM dasm;
+	InitDisasm(dasm, start, max);
+	return Generate(dasm, GuessWildcards, count, margin, signature, error);
+}
 
+const std::string BytePatternGen(uint8_t *start, uint8_t *max) {
+	std::string rv;
+	BytePatternSignature signature;
+	const char *error;
+	BytePatternGenSignature(start, max, nullptr, 0, signature, error);
+	BytePatternGenRender(signature, rv);
 	return rv;
-}
\ No newline at end of file
+}
+
+bool BytePatternGenUnique(uint8_t *start, uint8_t *max, const std::function<size_t(Pattern *)>& count, int margin, std::string& pattern, std::string& error) {
+	BytePatternSignature signature;
+	const char *reason;
+	bool ok = BytePatternGenSignature(start, max, count, margin, signature, reason);
+	return Render(ok, signature, reason, pattern, error);
+}
+
+bool BytePatternGenImage(PEImage *image, uint32_t rva, const std::function<size_t(Pattern *)>& count, int margin, std::string& pattern, std::string& error) {
+	BytePatternSignature signature;
+	signature.size = 0;
+	DISASM dasm;
+	if (!InitImageDisasm(dasm, image, rva)) {
+		return Render(false, signature, "rva is not in a section's file data", pattern, error);
+	}
+	const char *reason;
+	bool ok = Generate(dasm, [image](DISASM& dasm, size_t len) {
+		return ImageWildcards(image, dasm, len);
+	}, count, margin, signature, reason);
+	return Render(ok, signature, reason, pattern, error);
+}
+
+bool BytePatternGenImages(const std::vector<BytePatternGenTarget>& targets, const std::function<size_t(size_t target, Pattern *)>& count, int margin, std::string& pattern, std::string& error) {
+	BytePatternSignature signature;
+	signature.size = 0;
+	if (targets.empty()) {
+		return Render(false, signature, "no targets", pattern, error);
+	}
+	std::vector<DISASM> dasms(targets.size());
+	for (size_t i = 0; i < targets.size(); ++i) {
+		if (!InitImageDisasm(dasms[i], targets[i].image, targets[i].rva)) {
+			return Render(false, signature, "rva is not in a section's file data", pattern, error);
+		}
+	}
+
+	AppendStep append = [&](BytePatternSignature& signature, const char *& error) -> bool {
+		int len = 0;
+		uint32_t wildcards = 0;
+		for (size_t i = 0; i < dasms.size(); ++i) {
+			DISASM& dasm = dasms[i];
+			int current = DisasmInBlock(dasm);
+			if (current == 0 && dasm.SecurityBlock < kTailSize) {
+				//nothing left, or only the start of an instruction cut off by the end of the section
+				error = "a build's section ended before the signature became unique";
+				return false;
+			}
+			if (current == 0 || dasm.Instruction.Opcode == 0xCC) {
+				return false;
+			}
+			//the builds must run the same instruction, only its operands may differ
+			if (i > 0 && (current != len || dasm.Instruction.Opcode != dasms[0].Instruction.Opcode)) {
+				error = "instructions differ between the images before the signature became unique";
+				return false;
+			}
+			len = current;
+			wildcards |= ImageWildcards(targets[i].image, dasm, len);
+			for (int pos = 0; i > 0 && pos < len; ++pos) {
+				if (reinterpret_cast<uint8_t *>(dasm.EIP)[pos] != reinterpret_cast<uint8_t *>(dasms[0].EIP)[pos]) {
+					wildcards |= 1u << pos;
+				}
+			}
+		}
+
+		if (signature.size + len > BytePatternSignature::kMaxBytes) {
+			return false;
+		}
+		auto bytes = reinterpret_cast<const uint8_t *>(dasms[0].EIP);
+		for (int pos = 0; pos < len; ++pos) {
+			bool wildcard = (wildcards & (1u << pos)) != 0;
+			signature.mask[signature.size] = wildcard ? 0 : 0xFF;
+			signature.value[signature.size] = wildcard ? 0 : bytes[pos];
+			++signature.size;
+		}
+		for (auto& dasm : dasms) {
+			Advance(dasm, len);
+		}
+		return true;
+	};
+
+	//unique in every image, a miss in any of them means the signature lost the target
+	std::function<size_t(Pattern *)> count_all;
+	if (count) {
+		count_all = [&](Pattern *p) -> size_t {
+			size_t most = 0;
+			for (size_t i = 0; i < targets.size(); ++i) {
+				size_t matches = count(i, p);
+				if (matches == 0) {
+					return 0;
+				}
+				most = std::max<size_t>(most, matches);
+			}
+			return most;
+		};
+	}
+	const char *reason;
+	bool ok = Generate(append, count_all, margin, signature, reason);
+	return Render(ok, signature, reason, pattern, error);
+}
+
+void BytePatternGenBatch(std::vector<BytePatternGenJob>& jobs, const std::function<size_t(size_t job, Pattern *)>& count, int margin) {
+	ParallelScan::Run(jobs.size(), [&](size_t i) {
+		BytePatternGenJob& job = jobs[i];
+		job.pattern.clear();
+		if (!job.error.empty()) {
+			return;
+		}
+		if (!job.begin || job.max <= job.begin) {
+			job.error = "address is not readable";
+			return;
+		}
+		std::function<size_t(Pattern *)> job_count;
+		if (count) {
+			job_count = [&count, i](Pattern *p) {
+				return count(i, p);
+			};
+		}
+		//generated in place, only the final signature is rendered
+		BytePatternSignature signature;
+		const char *error;
+		if (BytePatternGenSignature(job.begin, job.max, job_count, margin, signature, error)) {
+			BytePatternGenRender(signature, job.pattern);
+		}
+		else {
+			job.error = error;
+		}
+	});
+}
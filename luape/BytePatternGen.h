@@ -1,4 +1,58 @@
+#pragma once
+
 #include <cstdint>
 #include <string>
+#include <vector>
+#include <functional>
+#include "BytePattern.h"
+
+class PEImage;
+
+//generated bytes, wildcards have a zero mask and value, sized for the longest signature so generating never allocates
+struct BytePatternSignature {
+	static const size_t kMaxInstructions = 20;
+	static const size_t kMaxBytes = kMaxInstructions * 2 * 15; //up to as many margin instructions again
+
+	uint8_t mask[kMaxBytes];
+	uint8_t value[kMaxBytes];
+	size_t size;
+};
+
+//generates into signature, which BytePattern::CompilePattern turns into a pattern without a text round trip,
+//unique like BytePatternGenUnique when count is set, error points to a static reason on failure
+bool BytePatternGenSignature(uint8_t *begin, uint8_t *max, const std::function<size_t(Pattern *)>& count, int margin, BytePatternSignature& signature, const char *& error);
+//the text form ("55 8B EC ?? ??")
+void BytePatternGenRender(const BytePatternSignature& signature, std::string& pattern);
+
+const std::string BytePatternGen(uint8_t *begin, uint8_t *max);
+
+//grows the signature one instruction at a time until count (which may stop at 2) reports a single match,
+//then appends up to margin more instructions, returns false with a reason when no prefix is unique
+bool BytePatternGenUnique(uint8_t *begin, uint8_t *max, const std::function<size_t(Pattern *)>& count, int margin, std::string& pattern, std::string& error);
+
+//signature of the code at rva of a file image, disassembled at its preferred address, leaving out exactly the bytes
+//patched by base relocations and the displacements of direct branches, grows until unique like BytePatternGenUnique
+//when count is set and stops at the instruction limit otherwise
+bool BytePatternGenImage(PEImage *image, uint32_t rva, const std::function<size_t(Pattern *)>& count, int margin, std::string& pattern, std::string& error);
+
+struct BytePatternGenTarget {
+	PEImage *image;
+	uint32_t rva;
+};
+
+//one signature for the same code in several builds, the instruction streams are walked in lockstep and bytes that differ
+//between the builds are left out too, with count (called per target) it grows until every image has a single match
+bool BytePatternGenImages(const std::vector<BytePatternGenTarget>& targets, const std::function<size_t(size_t target, Pattern *)>& count, int margin, std::string& pattern, std::string& error);
+
+struct BytePatternGenJob {
+	uint8_t *begin;
+	uint8_t *max;
+	const uint8_t *module; //where the caller's count looks for other matches of this job
+	size_t module_size;
+	std::string pattern;
+	std::string error; //empty when pattern was generated, jobs handed in with an error are skipped
+};
 
-const std::string BytePatternGen(uint8_t *begin, uint8_t *max);
\ No newline at end of file
+//generates all jobs on the ParallelScan worker pool, each with its own disassembler state, unique signatures when count
+//(called per job) is set (it is called from the workers and must not scan in parallel itself), plain BytePatternGen ones otherwise
+void BytePatternGenBatch(std::vector<BytePatternGenJob>& jobs, const std::function<size_t(size_t job, Pattern *)>& count, int margin);
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+//compile time patterns for native callers, every byte is a template argument so the mask/value arrays are constant data
+//and the matcher is a fully inlined comparison chain, no parsing and no allocation:
+//	typedef BytePatternLiteral<0x8B, 0x0D, kAnyByte, kAnyByte, kAnyByte, kAnyByte, BYTE_PATTERN_NIBBLE_HIGH(0x8)> GlobalLoad;
+//	const uint8_t *hit = GlobalLoad::Find(data, size);
+//arguments are 0x00 - 0xFF for a literal byte, kAnyByte for a wildcard or BYTE_PATTERN_MASKED(mask, value),
+//anything else fails to compile
+
+static const int kAnyByte = -1;
+#define BYTE_PATTERN_MASKED(mask, value) (0x10000 | ((mask) & 0xFF) << 8 | ((value) & 0xFF))
+#define BYTE_PATTERN_NIBBLE_HIGH(nibble) BYTE_PATTERN_MASKED(0xF0, (nibble) << 4) //"8?"
+#define BYTE_PATTERN_NIBBLE_LOW(nibble) BYTE_PATTERN_MASKED(0x0F, (nibble)) //"?8"
+
+template <int Byte>
+struct BytePatternByte {
+	static const bool kValid = Byte == kAnyByte || (Byte >= 0 && Byte <= 0xFF) ||
+		((Byte >> 16) == 1 && (Byte & 0xFF & ~(Byte >> 8 & 0xFF)) == 0);
+	static const uint8_t kMask = Byte == kAnyByte ? 0 : Byte <= 0xFF ? 0xFF : (Byte >> 8 & 0xFF);
+	static const uint8_t kValue = Byte == kAnyByte ? 0 : (Byte & 0xFF);
+};
+
+//0 for the most common byte in x86 code, the same order as BytePattern's anchor table, 16 for bytes outside the top 16
+template <uint8_t Value>
+struct BytePatternRarity {
+	static const int value =
+		Value == 0x00 ? 0 : Value == 0xFF ? 1 : Value == 0xCC ? 2 : Value == 0x8B ? 3 :
+		Value == 0x48 ? 4 : Value == 0x89 ? 5 : Value == 0x24 ? 6 : Value == 0x44 ? 7 :
+		Value == 0x45 ? 8 : Value == 0x4C ? 9 : Value == 0x83 ? 10 : Value == 0xE8 ? 11 :
+		Value == 0x0F ? 12 : Value == 0x01 ? 13 : Value == 0x04 ? 14 : Value == 0x08 ? 15 : 16;
+};
+
+template <int... Bytes>
+struct BytePatternMatcher;
+
+template <>
+struct BytePatternMatcher<> {
+	static const bool kValid = true;
+	//rarest fully specified byte, the scan looks for it with memchr
+	static const int kAnchor = -1;
+	static const int kAnchorRarity = -1;
+	static const uint8_t kAnchorValue = 0;
+	static bool Match(const uint8_t *) { return true; }
+};
+
+template <int First, int... Rest>
+struct BytePatternMatcher<First, Rest...> {
+	typedef BytePatternByte<First> Byte;
+	typedef BytePatternMatcher<Rest...> Next;
+
+	static const bool kValid = Byte::kValid && Next::kValid;
+	static const int kRarity = Byte::kMask == 0xFF ? BytePatternRarity<Byte::kValue>::value : -1;
+	static const bool kOwnAnchor = kRarity >= 0 && kRarity >= Next::kAnchorRarity;
+	static const int kAnchor = kOwnAnchor ? 0 : Next::kAnchor < 0 ? -1 : Next::kAnchor + 1;
+	static const int kAnchorRarity = kOwnAnchor ? kRarity : Next::kAnchorRarity;
+	static const uint8_t kAnchorValue = kOwnAnchor ? Byte::kValue : Next::kAnchorValue;
+
+	//wildcards fold away, every other byte is a single compare against constants
+	static bool Match(const uint8_t *pos) {
+		return (Byte::kMask == 0 || (pos[0] & Byte::kMask) == Byte::kValue) && Next::Match(pos + 1);
+	}
+};
+
+template <int... Bytes>
+class BytePatternLiteral {
+	typedef BytePatternMatcher<Bytes...> Matcher;
+public:
+	static const size_t kSize = sizeof...(Bytes);
+	static const int kAnchor = Matcher::kAnchor;
+	static const uint8_t kMask[sizeof...(Bytes)];
+	static const uint8_t kValue[sizeof...(Bytes)];
+
+	static_assert(sizeof...(Bytes) > 0, "byte pattern is empty");
+	static_assert(Matcher::kValid, "byte pattern has an argument that is not 0x00 - 0xFF, kAnyByte or BYTE_PATTERN_MASKED");
+	static_assert(Matcher::kAnchor >= 0, "byte pattern needs at least one fully specified byte");
+
+	//the whole pattern has to fit, trailing wildcards included
+	static bool Match(const void *buffer, size_t size) {
+		return size >= kSize && Matcher::Match(reinterpret_cast<const uint8_t *>(buffer));
+	}
+
+	static const uint8_t * Find(const void *range_begin, size_t size) {
+		if (size < kSize) {
+			return nullptr;
+		}
+		const uint8_t *begin = reinterpret_cast<const uint8_t *>(range_begin);
+		const uint8_t *last = begin + size - kSize;
+		const uint8_t anchor = Matcher::kAnchorValue;
+		for (const uint8_t *pos = begin + kAnchor; pos <= last + kAnchor;) {
+			pos = reinterpret_cast<const uint8_t *>(memchr(pos, anchor, last + kAnchor - pos + 1));
+			if (!pos) {
+				return nullptr;
+			}
+			if (Matcher::Match(pos - kAnchor)) {
+				return pos - kAnchor;
+			}
+			++pos;
+		}
+		return nullptr;
+	}
+
+	static size_t FindAll(const void *range_begin, size_t size, const std::function<bool(const void *)>& visit) {
+		const uint8_t *pos = reinterpret_cast<const uint8_t *>(range_begin), *end = pos + size;
+		size_t hits = 0;
+		while (const uint8_t *hit = Find(pos, end - pos)) {
+			++hits;
+			if (!visit(hit)) {
+				break;
+			}
+			pos = hit + 1;
+		}
+		return hits;
+	}
+};
+
+template <int... Bytes>
+const uint8_t BytePatternLiteral<Bytes...>::kMask[sizeof...(Bytes)] = { BytePatternByte<Bytes>::kMask... };
+
+template <int... Bytes>
+const uint8_t BytePatternLiteral<Bytes...>::kValue[sizeof...(Bytes)] = { BytePatternByte<Bytes>::kValue... };
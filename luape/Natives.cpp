@@ -1,5 +1,7 @@
 #include "Natives.h"
 #include <vector>
+#include <memory>
+#include <new>
 #include <Windows.h>
 #include <lua.hpp>
 #include <cstdint>
@@ -7,11 +9,18 @@
 #include <BeaEngine\BeaEngine.h>
 #include "BytePattern.h"
 #include "BytePatternGen.h"
+#include "PatternSet.h"
+#include "PatternCache.h"
+#include "ParallelScan.h"
 #include "PEImage.h"
+#include "PatternIndex.h"
+#include "StreamScanner.h"
+#include "SignatureDb.h"
 
 static HMODULE BaseImageModule;
 static size_t BaseImageModuleSize;
 static char CWD[MAX_PATH + 1];
+static PatternCache *CompiledPatterns = new PatternCache(); //outlives any lua state closed during static destruction
 
 static uint32_t GetMaxReadableSize(void *ptr) {
 	MEMORY_BASIC_INFORMATION mbi;
@@ -40,6 +49,194 @@ static uint32_t GetMaxReadableSizeInImage(void *ptr, PEImage *image) {
 	return image->size() - (ptr_v - image_base_v);
 }
 
+//the loaded module containing ptr, generated signatures are made unique within it
+static bool GetContainingModule(const void *ptr, const uint8_t *& base, size_t& size) {
+	HMODULE module;
+	MODULEINFO mi;
+	if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, reinterpret_cast<LPCSTR>(ptr), &module)
+		|| !GetModuleInformation(GetCurrentProcess(), module, &mi, sizeof(mi))) {
+		return false;
+	}
+	base = reinterpret_cast<const uint8_t *>(mi.lpBaseOfDll);
+	size = mi.SizeOfImage;
+	return true;
+}
+
+//pushes a table keyed like the set's source table, members without a match are left out
+static void PushPatternSetResults(lua_State *L, int set_index, const std::vector<const void *>& results, const uint8_t *base) {
+	lua_newtable(L);
+	lua_getuservalue(L, set_index);
+	for (size_t i = 0; i < results.size(); ++i) {
+		if (results[i]) {
+			lua_rawgeti(L, -1, i + 1);
+			lua_pushunsigned(L, reinterpret_cast<const uint8_t *>(results[i]) - base);
+			lua_rawset(L, -4);
+		}
+	}
+	lua_pop(L, 1);
+}
+
+enum ScanResultKind {
+	kScanResultOffset,
+	kScanResultRVA,
+	kScanResultVA,
+};
+
+//reads an optional scan options table:
+//	{ section = ".text", characteristics = luape.IMAGE_SCN_MEM_EXECUTE, rvaFrom = 0x1000, rvaTo = 0x2000,
+//	  vaFrom = ..., vaTo = ..., result = "offset" | "rva" | "va" }
+//without section, characteristics or address filters the whole file is scanned, split at section boundaries
+//when an rva or va result is asked for so every match can be mapped by the range it was found in
+static void CheckScanOptions(lua_State *L, int index, PEImage *image, std::vector<ImageRange>& ranges, ScanResultKind& kind) {
+	kind = kScanResultOffset;
+	ranges.clear();
+	if (lua_isnoneornil(L, index)) {
+		ImageRange all = { 0, image->size(), 0, false };
+		ranges.push_back(all);
+		return;
+	}
+	luaL_checktype(L, index, LUA_TTABLE);
+
+	bool filtered = false;
+	const char *section = NULL;
+	uint32_t characteristics = 0, rva_from = 0, rva_to = 0xFFFFFFFF;
+	lua_getfield(L, index, "section");
+	if (!lua_isnil(L, -1)) {
+		section = luaL_checkstring(L, -1);
+		filtered = true;
+	}
+	lua_getfield(L, index, "characteristics");
+	if (!lua_isnil(L, -1)) {
+		characteristics = luaL_checkunsigned(L, -1);
+		filtered = true;
+	}
+	lua_getfield(L, index, "rvaFrom");
+	if (!lua_isnil(L, -1)) {
+		rva_from = luaL_checkunsigned(L, -1);
+		filtered = true;
+	}
+	lua_getfield(L, index, "rvaTo");
+	if (!lua_isnil(L, -1)) {
+		rva_to = luaL_checkunsigned(L, -1);
+		filtered = true;
+	}
+	lua_getfield(L, index, "vaFrom");
+	if (!lua_isnil(L, -1)) {
+		lua_Unsigned va = luaL_checkunsigned(L, -1);
+		if (va < image->image_base()) {
+			luaL_argerror(L, index, "vaFrom is below the image base");
+		}
+		rva_from = va - image->image_base();
+		filtered = true;
+	}
+	lua_getfield(L, index, "vaTo");
+	if (!lua_isnil(L, -1)) {
+		lua_Unsigned va = luaL_checkunsigned(L, -1);
+		if (va < image->image_base()) {
+			luaL_argerror(L, index, "vaTo is below the image base");
+		}
+		rva_to = va - image->image_base();
+		filtered = true;
+	}
+	lua_getfield(L, index, "result");
+	if (!lua_isnil(L, -1)) {
+		const char *name = luaL_checkstring(L, -1);
+		if (strcmp(name, "rva") == 0) {
+			kind = kScanResultRVA;
+		}
+		else if (strcmp(name, "va") == 0) {
+			kind = kScanResultVA;
+		}
+		else if (strcmp(name, "offset") != 0) {
+			luaL_error(L, "unknown scan result kind: %s", name);
+		}
+	}
+
+	if (filtered) {
+		ranges = image->FindSectionRanges(section, characteristics, rva_from, rva_to);
+	}
+	else if (kind != kScanResultOffset) {
+		ranges = image->FindFileRanges();
+	}
+	else {
+		ImageRange all = { 0, image->size(), 0, false };
+		ranges.push_back(all);
+	}
+	lua_pop(L, 7);
+}
+
+//the offset, rva or va of a match found at offset inside range, false for file data the image does not map
+static bool GetScanResult(PEImage *image, const ImageRange& range, uint32_t offset, ScanResultKind kind, lua_Unsigned& result) {
+	if (kind == kScanResultOffset) {
+		result = offset;
+		return true;
+	}
+	if (!range.mapped) {
+		return false;
+	}
+
+	uint32_t rva = range.rva + (offset - range.offset);
+	result = kind == kScanResultVA ? image->image_base() + rva : rva;
+	return true;
+}
+
+//callers release their C++ locals before raising this
+static int UnmappedResultError(lua_State *L, uint32_t offset) {
+	return luaL_error(L, "match at file offset 0x%X is not mapped by the image and has no rva", offset);
+}
+
+//pushes the decoded captures of a match, returns how many were pushed, 64-bit ones go out as hex strings
+//("0x...", "-0x..." for negative i64) because a lua number only holds 53 bits exactly
+static int PushCaptures(lua_State *L, Pattern *p, const void *match) {
+	luaL_checkstack(L, static_cast<int>(p->captures.size()), "too many captures");
+	for (auto& capture : p->captures) {
+		int64_t value = BytePattern::DecodeCapture(capture, match);
+		if (capture.size == 8) {
+			bool negative = capture.is_signed && value < 0;
+			uint64_t magnitude = negative ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+			char text[24];
+			sprintf_s(text, "%s0x%llX", negative ? "-" : "", magnitude);
+			lua_pushstring(L, text);
+		}
+		else {
+			lua_pushnumber(L, capture.is_signed ? static_cast<lua_Number>(value) : static_cast<lua_Number>(static_cast<uint64_t>(value)));
+		}
+	}
+	return static_cast<int>(p->captures.size());
+}
+
+//first match in [from, to) of the image, answered by the gram index when one is attached
+static const void * FindInImage(PEImage *image, Pattern *p, uint32_t from, uint32_t to, bool parallel = true) {
+	PatternIndex *index = image->index();
+	if (index) {
+		const void *found = nullptr;
+		if (index->FindAll(p, image->data(), from, to, [&](uint32_t offset) {
+			found = image->data() + offset;
+			return false;
+		})) {
+			return found;
+		}
+	}
+	if (parallel) {
+		return ParallelScan::Find(p, image->data() + from, to - from, &image->frequency());
+	}
+	return BytePattern::Find(p, image->data() + from, to - from, &image->frequency());
+}
+
+//matches in [from, to) counted up to limit (0 = unlimited)
+static size_t CountInImage(PEImage *image, Pattern *p, uint32_t from, uint32_t to, size_t limit) {
+	PatternIndex *index = image->index();
+	if (index) {
+		size_t count = 0;
+		if (index->FindAll(p, image->data(), from, to, [&](uint32_t) {
+			return ++count != limit;
+		})) {
+			return count;
+		}
+	}
+	return ParallelScan::Count(p, image->data() + from, to - from, limit, &image->frequency());
+}
+
 void NativesRegister(lua_State *L) {
 	BaseImageModule = GetModuleHandle(NULL);
 	MODULEINFO mi = { 0 };
@@ -51,7 +248,16 @@ void NativesRegister(lua_State *L) {
 	lua_pushstring(L, "__gc");
 	lua_pushcfunction(L, [](lua_State *L) -> int {
 		Pattern *pattern = *reinterpret_cast<Pattern **>(luaL_checkudata(L, 1, "luape.pattern"));
-		BytePattern::DestroyPattern(pattern);
+		CompiledPatterns->Release(pattern);
+		return 0;
+	});
+	lua_rawset(L, -3);
+
+	luaL_newmetatable(L, "luape.patternset");
+	lua_pushstring(L, "__gc");
+	lua_pushcfunction(L, [](lua_State *L) -> int {
+		PatternSet *set = *reinterpret_cast<PatternSet **>(luaL_checkudata(L, 1, "luape.patternset"));
+		BytePatternSet::DestroyPatternSet(set);
 		return 0;
 	});
 	lua_rawset(L, -3);
@@ -195,13 +401,14 @@ void NativesRegister(lua_State *L) {
 					}
 					if (lua_gettop(L) > 3) {
 						to = luaL_checkunsigned(L, 4);
-						if (to > image->size()) {
+						if (to > image->size() || to <= from) {
 							return luaL_error(L, "out of image range");
 						}
 					}
-					const void *ptr = BytePattern::Find(p, image->data() + from, image->size() - from);
+					const void *ptr = FindInImage(image, p, from, to);
 					if (ptr) {
 						lua_pushunsigned(L, reinterpret_cast<const uint8_t *>(ptr)-image->data());
+						return 1 + PushCaptures(L, p, ptr);
 					}
 					else {
 						lua_pushnil(L);
@@ -214,6 +421,366 @@ void NativesRegister(lua_State *L) {
 			}
 		},
 
+		{
+			"findPattern", [](lua_State *L) -> int {
+				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
+				Pattern *p = *reinterpret_cast<Pattern **>(luaL_checkudata(L, 2, "luape.pattern"));
+				if (!image->IsLoaded()) {
+					lua_pushnil(L);
+					return 1;
+				}
+				ScanResultKind kind;
+				ImageRange found_range;
+				const void *ptr = nullptr;
+				{
+					std::vector<ImageRange> ranges;
+					CheckScanOptions(L, 3, image, ranges, kind);
+					for (auto& range : ranges) {
+						ptr = FindInImage(image, p, range.offset, range.offset + range.size);
+						if (ptr) {
+							found_range = range;
+							break;
+						}
+					}
+				}
+				if (!ptr) {
+					lua_pushnil(L);
+					return 1;
+				}
+				uint32_t offset = reinterpret_cast<const uint8_t *>(ptr) - image->data();
+				lua_Unsigned result;
+				if (!GetScanResult(image, found_range, offset, kind, result)) {
+					return UnmappedResultError(L, offset);
+				}
+				lua_pushunsigned(L, result);
+				return 1 + PushCaptures(L, p, ptr);
+			}
+		},
+
+		{
+			"countMatches", [](lua_State *L) -> int {
+				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
+				Pattern *p = *reinterpret_cast<Pattern **>(luaL_checkudata(L, 2, "luape.pattern"));
+				lua_Unsigned limit = 0;
+				if (lua_gettop(L) > 2 && !lua_isnil(L, 3)) {
+					limit = luaL_checkunsigned(L, 3);
+				}
+				if (!image->IsLoaded()) {
+					lua_pushunsigned(L, 0);
+					return 1;
+				}
+				std::vector<ImageRange> ranges;
+				ScanResultKind kind;
+				CheckScanOptions(L, 4, image, ranges, kind);
+				size_t count = 0;
+				for (auto& range : ranges) {
+					count += CountInImage(image, p, range.offset, range.offset + range.size, limit ? static_cast<size_t>(limit - count) : 0);
+					if (limit && count >= limit) {
+						break;
+					}
+				}
+				lua_pushunsigned(L, count);
+				return 1;
+			}
+		},
+
+		{
+			"findFuzzy", [](lua_State *L) -> int {
+				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
+				Pattern *p = *reinterpret_cast<Pattern **>(luaL_checkudata(L, 2, "luape.pattern"));
+				int max_mismatches = luaL_checkint(L, 3);
+				lua_Unsigned limit = 0;
+				if (lua_gettop(L) > 3 && !lua_isnil(L, 4)) {
+					limit = luaL_checkunsigned(L, 4);
+				}
+				if (max_mismatches < 0) {
+					return luaL_error(L, "mismatch count is negative");
+				}
+				if (!image->IsLoaded()) {
+					lua_newtable(L);
+					return 1;
+				}
+				//the ranges and matches are released before an error for a result without an rva is raised
+				bool unmapped = false;
+				uint32_t unmapped_offset = 0;
+				{
+					std::vector<ImageRange> ranges;
+					ScanResultKind kind;
+					CheckScanOptions(L, 5, image, ranges, kind);
+
+					//every range keeps only its best limit matches, the overall best are among them
+					std::vector<FuzzyMatch> matches, range_matches;
+					for (auto& range : ranges) {
+						BytePattern::FindFuzzy(p, image->data() + range.offset, range.size, max_mismatches, range_matches, static_cast<size_t>(limit));
+						matches.insert(matches.end(), range_matches.begin(), range_matches.end());
+					}
+					std::stable_sort(matches.begin(), matches.end(), [](const FuzzyMatch& a, const FuzzyMatch& b) {
+						return a.mismatches < b.mismatches || (a.mismatches == b.mismatches && a.pos < b.pos);
+					});
+					if (limit && matches.size() > limit) {
+						matches.resize(static_cast<size_t>(limit));
+					}
+
+					lua_newtable(L);
+					int index = 1;
+					for (auto& match : matches) {
+						uint32_t offset = reinterpret_cast<const uint8_t *>(match.pos) - image->data();
+						auto range = std::find_if(ranges.begin(), ranges.end(), [offset](const ImageRange& candidate) {
+							return offset - candidate.offset < candidate.size;
+						});
+						lua_Unsigned result;
+						if (!GetScanResult(image, *range, offset, kind, result)) {
+							unmapped = true;
+							unmapped_offset = offset;
+							break;
+						}
+						lua_newtable(L);
+						lua_pushunsigned(L, result);
+						lua_setfield(L, -2, "result");
+						lua_pushinteger(L, match.mismatches);
+						lua_setfield(L, -2, "mismatches");
+						lua_rawseti(L, -2, index++);
+					}
+				}
+				if (unmapped) {
+					return UnmappedResultError(L, unmapped_offset);
+				}
+				return 1;
+			}
+		},
+
+		{
+			"resolvePattern", [](lua_State *L) -> int {
+				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
+				Pattern *p = *reinterpret_cast<Pattern **>(luaL_checkudata(L, 2, "luape.pattern"));
+				if (!image->IsLoaded()) {
+					lua_pushnil(L);
+					return 1;
+				}
+				std::vector<ImageRange> ranges;
+				ScanResultKind kind;
+				CheckScanOptions(L, 3, image, ranges, kind);
+				for (auto& range : ranges) {
+					const void *ptr = FindInImage(image, p, range.offset, range.offset + range.size);
+					if (!ptr) {
+						continue;
+					}
+					uint32_t rva = image->FindRVAByFileOffset(reinterpret_cast<const uint8_t *>(ptr) - image->data());
+					uint64_t resolved;
+					if (rva == 0 || !BytePattern::Resolve(p, rva, image->image_base(), [image](uint64_t address, void *buffer, size_t size) {
+						return address <= 0xFFFFFFFF && image->ReadRVA(static_cast<uint32_t>(address), buffer, size);
+					}, resolved) || resolved > 0xFFFFFFFF) {
+						break;
+					}
+					lua_pushunsigned(L, static_cast<lua_Unsigned>(resolved));
+					lua_pushunsigned(L, static_cast<lua_Unsigned>(image->image_base() + resolved));
+					return 2 + PushCaptures(L, p, ptr);
+				}
+				lua_pushnil(L);
+				return 1;
+			}
+		},
+
+		{
+			//rva, options { unique = true, margin = 1 }, returns the signature or nil and the reason
+			"generatePatternString", [](lua_State *L) -> int {
+				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
+				uint32_t rva = luaL_checkunsigned(L, 2);
+				bool unique = false;
+				int margin = 0;
+				if (!lua_isnoneornil(L, 3)) {
+					luaL_checktype(L, 3, LUA_TTABLE);
+					lua_getfield(L, 3, "unique");
+					unique = lua_toboolean(L, -1) != 0;
+					lua_getfield(L, 3, "margin");
+					margin = luaL_optint(L, -1, 0);
+					lua_pop(L, 2);
+				}
+				if (!image->IsLoaded()) {
+					lua_pushnil(L);
+					lua_pushstring(L, "image is not loaded");
+					return 2;
+				}
+				std::function<size_t(Pattern *)> count;
+				if (unique) {
+					count = [image](Pattern *p) {
+						return CountInImage(image, p, 0, image->size(), 2);
+					};
+				}
+				std::string pattern, error;
+				if (!BytePatternGenImage(image, rva, count, margin, pattern, error)) {
+					lua_pushnil(L);
+					lua_pushstring(L, error.c_str());
+					return 2;
+				}
+				lua_pushstring(L, pattern.c_str());
+				return 1;
+			}
+		},
+
+		{
+			"buildIndex", [](lua_State *L) -> int {
+				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
+				if (!image->IsLoaded()) {
+					lua_pushboolean(L, 0);
+					return 1;
+				}
+				std::string path = luaL_optstring(L, 2, (image->path() + ".lpidx").c_str());
+				//the postings take about four bytes per image byte, which a large image may not get in this process
+				std::unique_ptr<PatternIndex> index(new PatternIndex());
+				try {
+					index->Build(image->data(), image->size(), image->hash());
+				}
+				catch (const std::bad_alloc&) {
+					lua_pushnil(L);
+					lua_pushstring(L, "out of memory");
+					return 2;
+				}
+				bool saved = index->Save(path.c_str());
+				image->set_index(index.release());
+				lua_pushboolean(L, saved);
+				return 1;
+			}
+		},
+
+		{
+			"loadIndex", [](lua_State *L) -> int {
+				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
+				if (!image->IsLoaded()) {
+					lua_pushboolean(L, 0);
+					return 1;
+				}
+				std::string path = luaL_optstring(L, 2, (image->path() + ".lpidx").c_str());
+				PatternIndex *index = new PatternIndex();
+				if (!index->Load(path.c_str(), image->hash(), image->size())) {
+					delete index;
+					lua_pushboolean(L, 0);
+					return 1;
+				}
+				image->set_index(index);
+				lua_pushboolean(L, 1);
+				return 1;
+			}
+		},
+
+		{
+			"dropIndex", [](lua_State *L) -> int {
+				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
+				image->set_index(nullptr);
+				return 0;
+			}
+		},
+
+		{
+			"getSections", [](lua_State *L) -> int {
+				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
+				lua_newtable(L);
+				if (!image->IsLoaded()) {
+					return 1;
+				}
+				int index = 1;
+				for (auto section : image->sections()) {
+					const char *name = reinterpret_cast<const char *>(section->Name);
+					lua_newtable(L);
+					lua_pushlstring(L, name, strnlen(name, IMAGE_SIZEOF_SHORT_NAME));
+					lua_setfield(L, -2, "name");
+					lua_pushunsigned(L, section->VirtualAddress);
+					lua_setfield(L, -2, "rva");
+					lua_pushunsigned(L, section->Misc.VirtualSize);
+					lua_setfield(L, -2, "virtualSize");
+					lua_pushunsigned(L, section->PointerToRawData);
+					lua_setfield(L, -2, "offset");
+					lua_pushunsigned(L, section->SizeOfRawData);
+					lua_setfield(L, -2, "size");
+					lua_pushunsigned(L, section->Characteristics);
+					lua_setfield(L, -2, "characteristics");
+					lua_rawseti(L, -2, index++);
+				}
+				return 1;
+			}
+		},
+
+		{
+			"matches", [](lua_State *L) -> int {
+				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
+				luaL_checkudata(L, 2, "luape.pattern");
+				lua_Unsigned from = 0, to = image->size(), max_hits = 0;
+				if (lua_gettop(L) > 2 && !lua_isnil(L, 3)) {
+					from = luaL_checkunsigned(L, 3);
+				}
+				if (lua_gettop(L) > 3 && !lua_isnil(L, 4)) {
+					to = luaL_checkunsigned(L, 4);
+					if (to > image->size()) {
+						return luaL_error(L, "out of image range");
+					}
+				}
+				if (lua_gettop(L) > 4) {
+					max_hits = luaL_checkunsigned(L, 5);
+				}
+
+				//upvalues: image, pattern, next offset, end offset, hits left
+				lua_pushvalue(L, 1);
+				lua_pushvalue(L, 2);
+				lua_pushunsigned(L, from);
+				lua_pushunsigned(L, to);
+				lua_pushunsigned(L, max_hits ? max_hits : ~static_cast<lua_Unsigned>(0));
+				lua_pushcclosure(L, [](lua_State *L) -> int {
+					PEImage *image = *reinterpret_cast<PEImage **>(lua_touserdata(L, lua_upvalueindex(1)));
+					Pattern *p = *reinterpret_cast<Pattern **>(lua_touserdata(L, lua_upvalueindex(2)));
+					lua_Unsigned pos = lua_tounsigned(L, lua_upvalueindex(3));
+					lua_Unsigned to = lua_tounsigned(L, lua_upvalueindex(4));
+					lua_Unsigned hits_left = lua_tounsigned(L, lua_upvalueindex(5));
+					if (!image->IsLoaded() || to > image->size() || pos >= to || hits_left == 0) {
+						return 0;
+					}
+
+					const void *ptr = FindInImage(image, p, pos, to, false);
+					if (!ptr) {
+						lua_pushunsigned(L, to);
+						lua_replace(L, lua_upvalueindex(3));
+						return 0;
+					}
+
+					lua_Unsigned offset = reinterpret_cast<const uint8_t *>(ptr) - image->data();
+					lua_pushunsigned(L, offset + 1);
+					lua_replace(L, lua_upvalueindex(3));
+					lua_pushunsigned(L, hits_left - 1);
+					lua_replace(L, lua_upvalueindex(5));
+					lua_pushunsigned(L, offset);
+					return 1 + PushCaptures(L, p, ptr);
+				}, 5);
+				return 1;
+			}
+		},
+
+		{
+			"findPatternSet", [](lua_State *L) -> int {
+				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
+				PatternSet *set = *reinterpret_cast<PatternSet **>(luaL_checkudata(L, 2, "luape.patternset"));
+				if (!image->IsLoaded()) {
+					lua_newtable(L);
+					return 1;
+				}
+				lua_Unsigned from = 0, to = image->size();
+				if (lua_gettop(L) > 2) {
+					from = luaL_checkunsigned(L, 3);
+					if (from >= image->size()) {
+						return luaL_error(L, "out of image range");
+					}
+				}
+				if (lua_gettop(L) > 3) {
+					to = luaL_checkunsigned(L, 4);
+					if (to > image->size() || to < from) {
+						return luaL_error(L, "out of image range");
+					}
+				}
+				std::vector<const void *> results;
+				ParallelScan::FindSet(set, image->data() + from, to - from, results);
+				PushPatternSetResults(L, 2, results, image->data());
+				return 1;
+			}
+		},
+
 		{
 			"readPointerArray", [](lua_State *L) -> int {
 				PEImage *image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, 1, "luape.peimage"));
@@ -353,6 +920,119 @@ void NativesRegister(lua_State *L) {
 	});
 	lua_rawset(L, -3);
 
+	luaL_newmetatable(L, "luape.signaturedb");
+
+	lua_pushstring(L, "__index");
+	lua_newtable(L);
+	luaL_Reg db_methods[] = {
+		{
+			"count", [](lua_State *L) -> int {
+				SignatureDb *db = *reinterpret_cast<SignatureDb **>(luaL_checkudata(L, 1, "luape.signaturedb"));
+				lua_pushunsigned(L, db->count());
+				return 1;
+			}
+		},
+
+		{
+			"names", [](lua_State *L) -> int {
+				SignatureDb *db = *reinterpret_cast<SignatureDb **>(luaL_checkudata(L, 1, "luape.signaturedb"));
+				lua_createtable(L, static_cast<int>(db->count()), 0);
+				for (size_t i = 0; i < db->count(); ++i) {
+					lua_pushstring(L, db->name(i));
+					lua_rawseti(L, -2, static_cast<int>(i + 1));
+				}
+				return 1;
+			}
+		},
+
+		{
+			"source", [](lua_State *L) -> int {
+				SignatureDb *db = *reinterpret_cast<SignatureDb **>(luaL_checkudata(L, 1, "luape.signaturedb"));
+				int index = db->Find(luaL_checkstring(L, 2));
+				if (index < 0) {
+					lua_pushnil(L);
+				}
+				else {
+					lua_pushstring(L, db->source(index));
+				}
+				return 1;
+			}
+		},
+
+		{
+			"pattern", [](lua_State *L) -> int {
+				SignatureDb *db = *reinterpret_cast<SignatureDb **>(luaL_checkudata(L, 1, "luape.signaturedb"));
+				int index = db->Find(luaL_checkstring(L, 2));
+				if (index < 0) {
+					lua_pushnil(L);
+					return 1;
+				}
+				//shared with luape.pattern through the source text, a miss is rebuilt from the stored bytes
+				Pattern *compiled = CompiledPatterns->Acquire(db->source(index), [db, index]() {
+					return db->CreatePattern(index);
+				});
+				*reinterpret_cast<Pattern **>(lua_newuserdata(L, sizeof(Pattern *))) = compiled;
+				luaL_getmetatable(L, "luape.pattern");
+				lua_setmetatable(L, -2);
+				return 1;
+			}
+		},
+
+		{
+			"patternSet", [](lua_State *L) -> int {
+				SignatureDb *db = *reinterpret_cast<SignatureDb **>(luaL_checkudata(L, 1, "luape.signaturedb"));
+				std::vector<size_t> members;
+				if (lua_isnoneornil(L, 2)) {
+					for (size_t i = 0; i < db->count(); ++i) {
+						members.push_back(i);
+					}
+				}
+				else {
+					luaL_checktype(L, 2, LUA_TTABLE);
+					for (int i = 1, n = static_cast<int>(lua_rawlen(L, 2)); i <= n; ++i) {
+						lua_rawgeti(L, 2, i);
+						const char *name = luaL_checkstring(L, -1);
+						int index = db->Find(name);
+						if (index < 0) {
+							return luaL_error(L, "no signature named %s", name);
+						}
+						members.push_back(index);
+						lua_pop(L, 1);
+					}
+				}
+
+				//result keys are the signature names
+				lua_createtable(L, static_cast<int>(members.size()), 0);
+				int keys = lua_gettop(L);
+				std::vector<Pattern *> patterns;
+				for (size_t i = 0; i < members.size(); ++i) {
+					patterns.push_back(db->CreatePattern(members[i]));
+					lua_pushstring(L, db->name(members[i]));
+					lua_rawseti(L, keys, static_cast<int>(i + 1));
+				}
+				PatternSet *set = BytePatternSet::CreatePatternSet(patterns);
+				*reinterpret_cast<PatternSet **>(lua_newuserdata(L, sizeof(PatternSet *))) = set;
+				luaL_getmetatable(L, "luape.patternset");
+				lua_setmetatable(L, -2);
+				lua_pushvalue(L, keys);
+				lua_setuservalue(L, -2);
+				return 1;
+			}
+		},
+
+		{ NULL, NULL }
+	};
+	luaL_setfuncs(L, db_methods, 0);
+	lua_rawset(L, -3);
+
+	lua_pushstring(L, "__gc");
+	lua_pushcfunction(L, [](lua_State *L) -> int {
+		SignatureDb *db = *reinterpret_cast<SignatureDb **>(luaL_checkudata(L, 1, "luape.signaturedb"));
+		delete db;
+		return 0;
+	});
+	lua_rawset(L, -3);
+
 
 	lua_newtable(L);
 	char cwd[MAX_PATH + 1];
@@ -361,6 +1041,21 @@ void NativesRegister(lua_State *L) {
 	lua_pushstring(L, cwd);
 	lua_rawset(L, -3);
 
+	const struct {
+		const char *name;
+		uint32_t value;
+	} characteristics[] = {
+		{ "IMAGE_SCN_CNT_CODE", IMAGE_SCN_CNT_CODE },
+		{ "IMAGE_SCN_MEM_EXECUTE", IMAGE_SCN_MEM_EXECUTE },
+		{ "IMAGE_SCN_MEM_READ", IMAGE_SCN_MEM_READ },
+		{ "IMAGE_SCN_MEM_WRITE", IMAGE_SCN_MEM_WRITE },
+	};
+	for (auto& item : characteristics) {
+		lua_pushstring(L, item.name);
+		lua_pushunsigned(L, item.value);
+		lua_rawset(L, -3);
+	}
+
 	luaL_Reg natives[] = {
 		{
 			"newPE", [](lua_State *L) -> int {			
@@ -408,6 +1103,157 @@ void NativesRegister(lua_State *L) {
 			}
 		},
 
+		{
+			"generateUniquePatternString", [](lua_State *L) -> int {
+				lua_Unsigned addr = luaL_checkunsigned(L, 1);
+				int margin = luaL_optint(L, 2, 0);
+				lua_Unsigned size = GetMaxReadableSize((void *)addr);
+				if (lua_isnumber(L, 3)) {
+					lua_Unsigned size_arg = lua_tounsigned(L, 3);
+					if (size_arg < size) {
+						size = size_arg;
+					}
+				}
+				if (!addr || size == 0) {
+					lua_pushnil(L);
+					lua_pushstring(L, "address is not readable");
+					return 2;
+				}
+				uint8_t *ptr = (uint8_t *)addr;
+				const uint8_t *module;
+				size_t module_size;
+				if (!GetContainingModule(ptr, module, module_size)) {
+					lua_pushnil(L);
+					lua_pushstring(L, "address is not inside a loaded module");
+					return 2;
+				}
+				std::string pattern, error;
+				//unique within the module holding the address, a second hit is enough to reject a prefix
+				bool ok = BytePatternGenUnique(ptr, ptr + size, [module, module_size](Pattern *p) {
+					return ParallelScan::Count(p, module, module_size, 2);
+				}, margin, pattern, error);
+				if (!ok) {
+					lua_pushnil(L);
+					lua_pushstring(L, error.c_str());
+					return 2;
+				}
+				lua_pushstring(L, pattern.c_str());
+				return 1;
+			}
+		},
+
+		{
+			//addresses (or rvas of the host module with options.rva), options.unique, options.margin, options.size,
+			//returns { pattern = ... } or { error = ... } per address in input order
+			"generatePatternStrings", [](lua_State *L) -> int {
+				luaL_checktype(L, 1, LUA_TTABLE);
+				bool rva = false, unique = false;
+				int margin = 0;
+				lua_Unsigned size_limit = 0;
+				if (!lua_isnoneornil(L, 2)) {
+					luaL_checktype(L, 2, LUA_TTABLE);
+					lua_getfield(L, 2, "rva");
+					rva = lua_toboolean(L, -1) != 0;
+					lua_getfield(L, 2, "unique");
+					unique = lua_toboolean(L, -1) != 0;
+					lua_getfield(L, 2, "margin");
+					margin = luaL_optint(L, -1, 0);
+					lua_getfield(L, 2, "size");
+					size_limit = lua_isnil(L, -1) ? 0 : luaL_checkunsigned(L, -1);
+					lua_pop(L, 4);
+				}
+
+				//every address is checked before the jobs exist, a bad one raises an error with no C++ objects alive
+				size_t count = lua_rawlen(L, 1);
+				for (size_t i = 0; i < count; ++i) {
+					lua_rawgeti(L, 1, i + 1);
+					luaL_checkunsigned(L, -1);
+					lua_pop(L, 1);
+				}
+
+				//the readable sizes and modules are queried here, the workers only disassemble
+				std::vector<BytePatternGenJob> jobs(count);
+				for (size_t i = 0; i < count; ++i) {
+					lua_rawgeti(L, 1, i + 1);
+					lua_Unsigned addr = lua_tounsigned(L, -1);
+					lua_pop(L, 1);
+					BytePatternGenJob& job = jobs[i];
+					uint8_t *ptr = (uint8_t *)addr;
+					job.module = reinterpret_cast<const uint8_t *>(BaseImageModule);
+					job.module_size = BaseImageModuleSize;
+					if (rva) {
+						ptr = addr < BaseImageModuleSize ? reinterpret_cast<uint8_t *>(BaseImageModule) + addr : nullptr;
+					}
+					else if (unique && ptr && !GetContainingModule(ptr, job.module, job.module_size)) {
+						job.error = "address is not inside a loaded module";
+					}
+					lua_Unsigned size = ptr ? GetMaxReadableSize(ptr) : 0;
+					if (size_limit && size_limit < size) {
+						size = size_limit;
+					}
+					job.begin = ptr;
+					job.max = ptr + size;
+				}
+
+				std::function<size_t(size_t, Pattern *)> match_count;
+				if (unique) {
+					match_count = [&jobs](size_t i, Pattern *p) {
+						return BytePattern::FindAll(p, jobs[i].module, jobs[i].module_size, [](const void *) { return true; }, 2);
+					};
+				}
+				BytePatternGenBatch(jobs, match_count, margin);
+
+				lua_createtable(L, static_cast<int>(count), 0);
+				for (size_t i = 0; i < count; ++i) {
+					lua_newtable(L);
+					if (jobs[i].error.empty()) {
+						lua_pushstring(L, jobs[i].pattern.c_str());
+						lua_setfield(L, -2, "pattern");
+					}
+					else {
+						lua_pushstring(L, jobs[i].error.c_str());
+						lua_setfield(L, -2, "error");
+					}
+					lua_rawseti(L, -2, i + 1);
+				}
+				return 1;
+			}
+		},
+
+		{
+			//{ { image, rva }, ... } locating the same code in several builds, margin,
+			//returns the shortest signature unique in every image or nil and the reason
+			"generateSharedPatternString", [](lua_State *L) -> int {
+				luaL_checktype(L, 1, LUA_TTABLE);
+				int margin = luaL_optint(L, 2, 0);
+				std::vector<BytePatternGenTarget> targets(lua_rawlen(L, 1));
+				for (size_t i = 0; i < targets.size(); ++i) {
+					lua_rawgeti(L, 1, i + 1);
+					luaL_checktype(L, -1, LUA_TTABLE);
+					lua_rawgeti(L, -1, 1);
+					targets[i].image = *reinterpret_cast<PEImage **>(luaL_checkudata(L, -1, "luape.peimage"));
+					lua_rawgeti(L, -2, 2);
+					targets[i].rva = luaL_checkunsigned(L, -1);
+					lua_pop(L, 3);
+					if (!targets[i].image->IsLoaded()) {
+						lua_pushnil(L);
+						lua_pushstring(L, "image is not loaded");
+						return 2;
+					}
+				}
+				std::string pattern, error;
+				if (!BytePatternGenImages(targets, [&targets](size_t i, Pattern *p) {
+					return CountInImage(targets[i].image, p, 0, targets[i].image->size(), 2);
+				}, margin, pattern, error)) {
+					lua_pushnil(L);
+					lua_pushstring(L, error.c_str());
+					return 2;
+				}
+				lua_pushstring(L, pattern.c_str());
+				return 1;
+			}
+		},
+
 		{
 			"selectFile", [](lua_State *L) -> int {
 				const char *title = NULL;
@@ -480,18 +1326,30 @@ void NativesRegister(lua_State *L) {
 
 		{
 			"pattern", [](lua_State *L) -> int {
-				const char *pattern = luaL_checkstring(L, 1);
-				if (strlen(pattern) == 0) {
+				size_t len;
+				const char *pattern = luaL_checklstring(L, 1, &len);
+				if (len == 0) {
 					lua_pushfstring(L, "empty pattern string");
 					return lua_error(L);
 				}
-				*reinterpret_cast<Pattern **>(lua_newuserdata(L, sizeof(Pattern *))) = BytePattern::CreatePattern(pattern);
+				Pattern *compiled = CompiledPatterns->Acquire(std::string(pattern, len));
+				if (!compiled) {
+					return luaL_error(L, "invalid pattern string: %s", pattern);
+				}
+				*reinterpret_cast<Pattern **>(lua_newuserdata(L, sizeof(Pattern *))) = compiled;
 				luaL_getmetatable(L, "luape.pattern");
 				lua_setmetatable(L, -2);
 				return 1;
 			}
 		},
 
+		{
+			"setPatternCacheSize", [](lua_State *L) -> int {
+				CompiledPatterns->set_capacity(luaL_checkunsigned(L, 1));
+				return 0;
+			}
+		},
+
 		{
 			"findPatternOffset", [](lua_State *L) -> int {
 				Pattern *p = *reinterpret_cast<Pattern **>(luaL_checkudata(L, 1, "luape.pattern"));
@@ -503,9 +1361,10 @@ void NativesRegister(lua_State *L) {
 					}
 				}
 				uint8_t *base = reinterpret_cast<uint8_t *>(BaseImageModule) + from;
-				const void *ptr = BytePattern::Find(p, base, BaseImageModuleSize - from);
+				const void *ptr = ParallelScan::Find(p, base, BaseImageModuleSize - from);
 				if (ptr) {
 					lua_pushunsigned(L, reinterpret_cast<const uint8_t *>(ptr)-base);
+					return 1 + PushCaptures(L, p, ptr);
 				}
 				else {
 					lua_pushnil(L);
@@ -514,6 +1373,160 @@ void NativesRegister(lua_State *L) {
 			}
 		},
 
+		{
+			"buildSignatureDb", [](lua_State *L) -> int {
+				const char *path = luaL_checkstring(L, 1);
+				std::vector<std::pair<std::string, std::string>> signatures;
+				std::string error;
+				if (lua_type(L, 2) == LUA_TSTRING) {
+					if (!SignatureDb::ParseText(lua_tostring(L, 2), signatures, error)) {
+						return luaL_error(L, "%s", error.c_str());
+					}
+				}
+				else {
+					luaL_checktype(L, 2, LUA_TTABLE);
+					lua_pushnil(L);
+					while (lua_next(L, 2)) {
+						if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING) {
+							return luaL_error(L, "signatures are not name = pattern string pairs");
+						}
+						signatures.push_back(std::make_pair(std::string(lua_tostring(L, -2)), std::string(lua_tostring(L, -1))));
+						lua_pop(L, 1);
+					}
+				}
+				if (!SignatureDb::Build(signatures, path, error)) {
+					return luaL_error(L, "%s", error.c_str());
+				}
+				lua_pushunsigned(L, signatures.size());
+				return 1;
+			}
+		},
+
+		{
+			"openSignatureDb", [](lua_State *L) -> int {
+				const char *path = luaL_checkstring(L, 1);
+				SignatureDb *db = new SignatureDb();
+				if (!db->Open(path)) {
+					delete db;
+					lua_pushnil(L);
+					lua_pushfstring(L, "cannot open signature database: %s", path);
+					return 2;
+				}
+				*reinterpret_cast<SignatureDb **>(lua_newuserdata(L, sizeof(SignatureDb *))) = db;
+				luaL_setmetatable(L, "luape.signaturedb");
+				return 1;
+			}
+		},
+
+		{
+			"countPatternMatches", [](lua_State *L) -> int {
+				Pattern *p = *reinterpret_cast<Pattern **>(luaL_checkudata(L, 1, "luape.pattern"));
+				lua_Unsigned limit = 0, from = 0;
+				if (lua_gettop(L) > 1 && !lua_isnil(L, 2)) {
+					limit = luaL_checkunsigned(L, 2);
+				}
+				if (lua_gettop(L) > 2) {
+					from = luaL_checkunsigned(L, 3);
+					if (from >= BaseImageModuleSize) {
+						return luaL_error(L, "out of image range");
+					}
+				}
+				uint8_t *base = reinterpret_cast<uint8_t *>(BaseImageModule) + from;
+				lua_pushunsigned(L, ParallelScan::Count(p, base, BaseImageModuleSize - from, limit));
+				return 1;
+			}
+		},
+
+		{
+			"scanFile", [](lua_State *L) -> int {
+				const char *path = luaL_checkstring(L, 1);
+				Pattern *p = *reinterpret_cast<Pattern **>(luaL_checkudata(L, 2, "luape.pattern"));
+				lua_Unsigned max_hits = 0;
+				if (lua_gettop(L) > 2 && !lua_isnil(L, 3)) {
+					max_hits = luaL_checkunsigned(L, 3);
+				}
+				//the table is built after the scan, a lua error inside the callback would jump over the scanner's C++ state
+				std::vector<uint64_t> offsets;
+				bool ok = StreamScanner::ScanFile(path, p, [&](uint64_t offset) -> bool {
+					offsets.push_back(offset);
+					return max_hits == 0 || offsets.size() < max_hits;
+				});
+				if (!ok) {
+					lua_pushnil(L);
+					lua_pushfstring(L, "cannot read file: %s", path);
+					return 2;
+				}
+				lua_createtable(L, static_cast<int>(offsets.size()), 0);
+				for (size_t i = 0; i < offsets.size(); ++i) {
+					//offsets beyond 4 GB do not fit lua_Unsigned on 32-bit builds
+					lua_pushnumber(L, static_cast<lua_Number>(offsets[i]));
+					lua_rawseti(L, -2, i + 1);
+				}
+				return 1;
+			}
+		},
+
+		{
+			"patternSet", [](lua_State *L) -> int {
+				luaL_checktype(L, 1, LUA_TTABLE);
+				std::vector<const char *> patterns;
+				lua_newtable(L);
+				int keys = lua_gettop(L);
+				lua_pushnil(L);
+				while (lua_next(L, 1)) {
+					if (lua_type(L, -1) != LUA_TSTRING || lua_rawlen(L, -1) == 0) {
+						return luaL_error(L, "pattern set member is not a pattern string");
+					}
+					patterns.push_back(lua_tostring(L, -1));
+					lua_pushvalue(L, -2);
+					lua_rawseti(L, keys, patterns.size());
+					lua_pop(L, 1);
+				}
+				PatternSet *set = BytePatternSet::CreatePatternSet(patterns);
+				if (!set) {
+					return luaL_error(L, "invalid pattern string in pattern set");
+				}
+				*reinterpret_cast<PatternSet **>(lua_newuserdata(L, sizeof(PatternSet *))) = set;
+				luaL_getmetatable(L, "luape.patternset");
+				lua_setmetatable(L, -2);
+				lua_pushvalue(L, keys);
+				lua_setuservalue(L, -2);
+				return 1;
+			}
+		},
+
+		{
+			"findPatternSetOffsets", [](lua_State *L) -> int {
+				PatternSet *set = *reinterpret_cast<PatternSet **>(luaL_checkudata(L, 1, "luape.patternset"));
+				lua_Unsigned from = 0;
+				if (lua_gettop(L) > 1) {
+					from = luaL_checkunsigned(L, 2);
+					if (from >= BaseImageModuleSize) {
+						return luaL_error(L, "out of image range");
+					}
+				}
+				uint8_t *base = reinterpret_cast<uint8_t *>(BaseImageModule);
+				std::vector<const void *> results;
+				ParallelScan::FindSet(set, base + from, BaseImageModuleSize - from, results);
+				PushPatternSetResults(L, 1, results, base);
+				return 1;
+			}
+		},
+
+		{
+			"setScanThreads", [](lua_State *L) -> int {
+				ParallelScan::SetThreads(luaL_checkunsigned(L, 1));
+				return 0;
+			}
+		},
+
+		{
+			"getScanThreads", [](lua_State *L) -> int {
+				lua_pushunsigned(L, ParallelScan::threads());
+				return 1;
+			}
+		},
+
 		{
 			"matchPattern", [](lua_State *L) -> int {
 				Pattern *p = *reinterpret_cast<Pattern **>(luaL_checkudata(L, 1, "luape.pattern"));
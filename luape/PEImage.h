@@ -4,11 +4,31 @@
 #include <cstdint>
 #include <exception>
 #include <algorithm>
+#include <memory>
 #include <Windows.h>
+#include "BytePattern.h"
+#include "PatternIndex.h"
+
+//a run of raw file data and the RVA it is mapped at, rva is meaningless unless mapped is set
+struct ImageRange {
+	uint32_t offset;
+	uint32_t size;
+	uint32_t rva;
+	bool mapped;
+};
+
+//bytes the loader patches when the image is not loaded at its preferred base
+struct ImageRelocation {
+	uint32_t rva;
+	uint32_t size;
+};
 
 class PEImage {
 public:
-	PEImage() : file_(NULL), map_(NULL), size_(0), data_(nullptr), image_base_(0) {}
+	PEImage() : file_(NULL), map_(NULL), size_(0), data_(nullptr), image_base_(0), hash_(0), relocations_parsed_(false) {
+		reloc_dir_.VirtualAddress = 0;
+		reloc_dir_.Size = 0;
+	}
 	~PEImage() {
 		Unload();
 	}
@@ -27,6 +47,14 @@ public:
 			data_ = nullptr;
 			image_base_ = 0;
 			sections_.clear();
+			frequency_.reset();
+			index_.reset();
+			path_.clear();
+			hash_ = 0;
+			reloc_dir_.VirtualAddress = 0;
+			reloc_dir_.Size = 0;
+			relocations_.clear();
+			relocations_parsed_ = false;
 		}
 	}
 
@@ -119,6 +147,10 @@ public:
 
 		file_ = file;
 		map_ = map;
+		path_ = path;
+		if (nt_headers->OptionalHeader.NumberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_BASERELOC) {
+			reloc_dir_ = nt_headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC];
+		}
 
 		const char *filename = path.c_str();
 		char version[32];
@@ -156,6 +188,26 @@ public:
 		}
 	}
 
+	//copies raw data at an RVA, fails unless the whole range lies in one section's file data
+	bool ReadRVA(uint32_t rva, void *buffer, size_t size) {
+		if (!IsLoaded()) {
+			return false;
+		}
+		auto iter = std::find_if(sections_.begin(), sections_.end(), [rva](const IMAGE_SECTION_HEADER* section) -> bool {
+			return section->VirtualAddress <= rva && section->VirtualAddress + section->SizeOfRawData > rva;
+		});
+		if (iter == sections_.end()) {
+			return false;
+		}
+		auto item = *iter;
+		uint32_t offset = item->PointerToRawData + (rva - item->VirtualAddress);
+		if (item->VirtualAddress + item->SizeOfRawData - rva < size || offset > size_ || size_ - offset < size) {
+			return false;
+		}
+		memcpy(buffer, data_ + offset, size);
+		return true;
+	}
+
 	uint32_t FindRVAByFileOffset(int offset) {
 		DWORD file_offset = static_cast<DWORD>(offset);
 		if (!IsLoaded() || offset < 0 || file_offset > size_) {
@@ -173,11 +225,142 @@ public:
 		}
 	}
 
+	//raw data of the sections matching name (any if NULL) and having all characteristics bits, clipped to [rva_from, rva_to)
+	std::vector<ImageRange> FindSectionRanges(const char *name, uint32_t characteristics, uint32_t rva_from, uint32_t rva_to) {
+		std::vector<ImageRange> ranges;
+		if (!IsLoaded()) {
+			return ranges;
+		}
+		for (auto section : sections_) {
+			if (name && strncmp(reinterpret_cast<const char *>(section->Name), name, IMAGE_SIZEOF_SHORT_NAME) != 0) {
+				continue;
+			}
+			if ((section->Characteristics & characteristics) != characteristics) {
+				continue;
+			}
+			if (section->PointerToRawData >= size_) {
+				continue;
+			}
+			uint32_t raw_size = std::min<uint32_t>(section->SizeOfRawData, size_ - section->PointerToRawData);
+			uint32_t begin = std::max<uint32_t>(section->VirtualAddress, rva_from);
+			uint32_t end = std::min<uint32_t>(section->VirtualAddress + raw_size, rva_to);
+			if (begin >= end) {
+				continue;
+			}
+			ImageRange range;
+			range.rva = begin;
+			range.offset = section->PointerToRawData + (begin - section->VirtualAddress);
+			range.size = end - begin;
+			range.mapped = true;
+			ranges.push_back(range);
+		}
+		std::sort(ranges.begin(), ranges.end(), [](const ImageRange& a, const ImageRange& b) {
+			return a.rva < b.rva;
+		});
+		return ranges;
+	}
+
+	//the whole file in file order, the headers map one-to-one and section data through the section table,
+	//bytes no section covers (overlay, padding between sections) come back unmapped
+	std::vector<ImageRange> FindFileRanges() {
+		std::vector<ImageRange> sections = FindSectionRanges(NULL, 0, 0, 0xFFFFFFFF), ranges;
+		std::sort(sections.begin(), sections.end(), [](const ImageRange& a, const ImageRange& b) {
+			return a.offset < b.offset;
+		});
+		uint32_t pos = 0;
+		for (auto& section : sections) {
+			if (section.offset > pos) {
+				ImageRange gap = { pos, section.offset - pos, pos, pos == 0 };
+				ranges.push_back(gap);
+			}
+			ranges.push_back(section);
+			pos = std::max<uint32_t>(pos, section.offset + section.size);
+		}
+		if (IsLoaded() && pos < size_) {
+			ImageRange gap = { pos, size_ - pos, pos, pos == 0 };
+			ranges.push_back(gap);
+		}
+		return ranges;
+	}
+
 	uint32_t size() const { return size_; }
 	const uint8_t * data() const { return data_;}
 	uint32_t image_base() const { return image_base_; }
 	const std::vector<IMAGE_SECTION_HEADER *>& sections() { return sections_; }
 	const std::string& version() { return version_; }
+	const std::string& path() { return path_; }
+
+	//64-bit content hash, identifies the data an index file was built for
+	uint64_t hash() {
+		if (!hash_) {
+			uint64_t h = 0x9E3779B97F4A7C15ULL ^ size_;
+			uint32_t pos = 0;
+			for (; pos + 8 <= size_; pos += 8) {
+				uint64_t word;
+				memcpy(&word, data_ + pos, 8);
+				h = (h ^ word) * 0xFF51AFD7ED558CCDULL;
+				h ^= h >> 32;
+			}
+			for (; pos < size_; ++pos) {
+				h = (h ^ data_[pos]) * 0x100000001B3ULL;
+			}
+			hash_ = h ? h : 1;
+		}
+		return hash_;
+	}
+
+	//base relocations sorted by rva, parsed on first use, a damaged block ends the list
+	const std::vector<ImageRelocation>& relocations() {
+		if (!relocations_parsed_ && IsLoaded()) {
+			relocations_parsed_ = true;
+			uint32_t pos = reloc_dir_.VirtualAddress, end = pos + reloc_dir_.Size;
+			IMAGE_BASE_RELOCATION block;
+			while (end > pos && end - pos >= sizeof(block) && ReadRVA(pos, &block, sizeof(block))) {
+				if (block.SizeOfBlock < sizeof(block) || block.SizeOfBlock > end - pos) {
+					break;
+				}
+				std::vector<WORD> entries((block.SizeOfBlock - sizeof(block)) / sizeof(WORD));
+				if (!entries.empty() && !ReadRVA(pos + sizeof(block), &entries[0], entries.size() * sizeof(WORD))) {
+					break;
+				}
+				for (auto entry : entries) {
+					if ((entry >> 12) != IMAGE_REL_BASED_HIGHLOW) {
+						continue; //padding, the headers are only read as 32-bit ones so no other type applies
+					}
+					ImageRelocation relocation;
+					relocation.rva = block.VirtualAddress + (entry & 0xFFF);
+					relocation.size = 4;
+					relocations_.push_back(relocation);
+				}
+				pos += block.SizeOfBlock;
+			}
+			std::sort(relocations_.begin(), relocations_.end(), [](const ImageRelocation& a, const ImageRelocation& b) {
+				return a.rva < b.rva;
+			});
+		}
+		return relocations_;
+	}
+
+	bool IsRelocated(uint32_t rva) {
+		auto& relocations = this->relocations();
+		auto iter = std::upper_bound(relocations.begin(), relocations.end(), rva, [](uint32_t rva, const ImageRelocation& relocation) {
+			return rva < relocation.rva;
+		});
+		return iter != relocations.begin() && rva - (iter - 1)->rva < (iter - 1)->size;
+	}
+
+	//optional gram index used by the pattern lookups when attached, nullptr otherwise
+	PatternIndex * index() { return index_.get(); }
+	void set_index(PatternIndex *index) { index_.reset(index); }
+
+	//byte statistics of the whole file, computed on first use to pick the rarest scan anchors
+	const ByteFrequency& frequency() {
+		if (!frequency_) {
+			frequency_.reset(new ByteFrequency());
+			BytePattern::ComputeFrequency(data_, size_, *frequency_);
+		}
+		return *frequency_;
+	}
 private:
 	HANDLE file_;
 	HANDLE map_;
@@ -186,4 +369,11 @@ private:
 	uint32_t image_base_;
 	std::vector<IMAGE_SECTION_HEADER *> sections_;
 	std::string version_;
+	std::unique_ptr<ByteFrequency> frequency_;
+	std::string path_;
+	uint64_t hash_;
+	std::unique_ptr<PatternIndex> index_;
+	IMAGE_DATA_DIRECTORY reloc_dir_;
+	std::vector<ImageRelocation> relocations_;
+	bool relocations_parsed_;
 };
\ No newline at end of file
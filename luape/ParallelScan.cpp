@@ -0,0 +1,173 @@
+#include "ParallelScan.h"
+#include "WorkerPool.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+struct ScanChunk {
+	size_t begin;
+	size_t size;
+};
+
+static std::unique_ptr<WorkerPool> g_pool;
+static size_t g_threads = 0;
+
+static WorkerPool& Pool() {
+	if (!g_pool) {
+		g_pool.reset(new WorkerPool(ParallelScan::threads()));
+	}
+	return *g_pool;
+}
+
+//returns false when the range is too small to be worth splitting
+static bool Split(size_t size, size_t span, std::vector<ScanChunk>& chunks) {
+	size_t threads = ParallelScan::threads();
+	if (threads <= 1 || span == 0 || size < span || size < ParallelScan::kMinChunkSize * 2) {
+		return false;
+	}
+
+	size_t starts = size - span + 1;
+	size_t count = std::min(threads * 4, starts / ParallelScan::kMinChunkSize);
+	if (count <= 1) {
+		return false;
+	}
+
+	size_t step = (starts + count - 1) / count;
+	for (size_t pos = 0; pos < starts; pos += step) {
+		ScanChunk chunk;
+		chunk.begin = pos;
+		chunk.size = std::min(step, starts - pos) + span - 1;
+		chunks.push_back(chunk);
+	}
+	return true;
+}
+
+void ParallelScan::SetThreads(size_t threads) {
+	if (threads == 0) {
+		threads = 1;
+	}
+	if (threads != ParallelScan::threads()) {
+		g_pool.reset();
+		g_threads = threads;
+	}
+}
+
+size_t ParallelScan::threads() {
+	if (g_threads == 0) {
+		g_threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	return g_threads;
+}
+
+const void * ParallelScan::Find(Pattern *pattern, const void *range_begin, size_t size, const ByteFrequency *frequency) {
+	std::vector<ScanChunk> chunks;
+	if (!pattern || !Split(size, pattern->span, chunks)) {
+		return BytePattern::Find(pattern, range_begin, size, frequency);
+	}
+
+	const uint8_t *begin = reinterpret_cast<const uint8_t *>(range_begin);
+	std::vector<const void *> hits(chunks.size(), nullptr);
+	std::atomic<size_t> first(chunks.size());
+	Pool().Run(chunks.size(), [&](size_t i) {
+		if (i > first) {
+			return; //an earlier chunk already matched
+		}
+		hits[i] = BytePattern::Find(pattern, begin + chunks[i].begin, chunks[i].size, frequency);
+		if (hits[i]) {
+			size_t current = first;
+			while (i < current && !first.compare_exchange_weak(current, i));
+		}
+	});
+
+	for (auto hit : hits) {
+		if (hit) {
+			return hit;
+		}
+	}
+	return nullptr;
+}
+
+size_t ParallelScan::FindAll(Pattern *pattern, const void *range_begin, size_t size, const std::function<bool(const void *)>& visit, size_t max_hits, const ByteFrequency *frequency) {
+	std::vector<ScanChunk> chunks;
+	if (!pattern || !Split(size, pattern->span, chunks)) {
+		return BytePattern::FindAll(pattern, range_begin, size, visit, max_hits, frequency);
+	}
+
+	const uint8_t *begin = reinterpret_cast<const uint8_t *>(range_begin);
+	std::vector<std::vector<const void *>> hits(chunks.size());
+	Pool().Run(chunks.size(), [&](size_t i) {
+		std::vector<const void *>& chunk_hits = hits[i];
+		BytePattern::FindAll(pattern, begin + chunks[i].begin, chunks[i].size, [&chunk_hits](const void *hit) {
+			chunk_hits.push_back(hit);
+			return true;
+		}, max_hits, frequency);
+	});
+
+	size_t visited = 0;
+	for (auto& chunk_hits : hits) {
+		for (auto hit : chunk_hits) {
+			++visited;
+			if (!visit(hit) || visited == max_hits) {
+				return visited;
+			}
+		}
+	}
+	return visited;
+}
+
+size_t ParallelScan::Count(Pattern *pattern, const void *range_begin, size_t size, size_t limit, const ByteFrequency *frequency) {
+	std::vector<ScanChunk> chunks;
+	if (!pattern || !Split(size, pattern->span, chunks)) {
+		return BytePattern::FindAll(pattern, range_begin, size, [](const void *) {
+			return true;
+		}, limit, frequency);
+	}
+
+	const uint8_t *begin = reinterpret_cast<const uint8_t *>(range_begin);
+	std::atomic<size_t> total(0);
+	Pool().Run(chunks.size(), [&](size_t i) {
+		if (limit && total >= limit) {
+			return;
+		}
+		BytePattern::FindAll(pattern, begin + chunks[i].begin, chunks[i].size, [&](const void *) {
+			return ++total < limit || !limit;
+		}, 0, frequency);
+	});
+
+	size_t count = total;
+	return limit ? std::min(count, limit) : count;
+}
+
+void ParallelScan::FindSet(PatternSet *set, const void *range_begin, size_t size, std::vector<const void *>& results) {
+	std::vector<ScanChunk> chunks;
+	if (!set || !Split(size, set->max_span, chunks)) {
+		BytePatternSet::Find(set, range_begin, size, results);
+		return;
+	}
+
+	//a chunk may report a match starting past its end, that only happens when no earlier chunk has one for the member
+	const uint8_t *begin = reinterpret_cast<const uint8_t *>(range_begin);
+	std::vector<std::vector<const void *>> hits(chunks.size());
+	Pool().Run(chunks.size(), [&](size_t i) {
+		BytePatternSet::Find(set, begin + chunks[i].begin, chunks[i].size, hits[i]);
+	});
+
+	results.assign(set->patterns.size(), nullptr);
+	for (auto& chunk_hits : hits) {
+		for (size_t i = 0; i < results.size(); ++i) {
+			if (!results[i]) {
+				results[i] = chunk_hits[i];
+			}
+		}
+	}
+}
+
+void ParallelScan::Run(size_t count, const std::function<void(size_t)>& task) {
+	if (count == 1 || threads() <= 1) {
+		for (size_t i = 0; i < count; ++i) {
+			task(i);
+		}
+		return;
+	}
+	Pool().Run(count, task);
+}
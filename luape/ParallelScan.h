@@ -0,0 +1,23 @@
+#pragma once
+
+#include <functional>
+#include "BytePattern.h"
+#include "PatternSet.h"
+
+//splits large ranges into chunks overlapping by the pattern span minus one and scans them on a shared worker pool,
+//results are merged in offset order so they do not depend on the thread count
+class ParallelScan {
+public:
+	static const size_t kMinChunkSize = 1024 * 1024;
+
+	static void SetThreads(size_t threads);
+	static size_t threads();
+
+	static const void * Find(Pattern *pattern, const void *range_begin, size_t size, const ByteFrequency *frequency = nullptr);
+	static size_t FindAll(Pattern *pattern, const void *range_begin, size_t size, const std::function<bool(const void *)>& visit, size_t max_hits = 0, const ByteFrequency *frequency = nullptr);
+	//number of matches, stops every chunk once limit (0 = unlimited) is reached so "is it unique" checks finish at the second hit
+	static size_t Count(Pattern *pattern, const void *range_begin, size_t size, size_t limit = 0, const ByteFrequency *frequency = nullptr);
+	static void FindSet(PatternSet *set, const void *range_begin, size_t size, std::vector<const void *>& results);
+	//runs task(0) .. task(count - 1) on the shared worker pool, tasks must not start parallel scans themselves
+	static void Run(size_t count, const std::function<void(size_t)>& task);
+};
@@ -0,0 +1,69 @@
+#include "PatternCache.h"
+
+PatternCache::PatternCache(size_t capacity) : capacity_(capacity) {}
+
+PatternCache::~PatternCache() {
+	for (auto& item : by_source_) {
+		BytePattern::DestroyPattern(item.second.pattern);
+	}
+}
+
+Pattern * PatternCache::Acquire(const std::string& source) {
+	return Acquire(source, [&source]() {
+		return BytePattern::CreatePattern(source.c_str());
+	});
+}
+
+Pattern * PatternCache::Acquire(const std::string& source, const std::function<Pattern *()>& compile) {
+	auto iter = by_source_.find(source);
+	if (iter != by_source_.end()) {
+		PatternCacheEntry& entry = iter->second;
+		if (entry.refs++ == 0) {
+			idle_.erase(entry.idle);
+		}
+		return entry.pattern;
+	}
+
+	Pattern *pattern = compile();
+	if (!pattern) {
+		return nullptr;
+	}
+
+	iter = by_source_.insert(std::make_pair(source, PatternCacheEntry())).first;
+	PatternCacheEntry& entry = iter->second;
+	entry.pattern = pattern;
+	entry.refs = 1;
+	entry.source = &iter->first;
+	by_pattern_[pattern] = &entry;
+	return pattern;
+}
+
+void PatternCache::Release(Pattern *pattern) {
+	auto iter = by_pattern_.find(pattern);
+	if (iter == by_pattern_.end()) {
+		BytePattern::DestroyPattern(pattern); //not ours
+		return;
+	}
+
+	PatternCacheEntry& entry = *iter->second;
+	if (--entry.refs == 0) {
+		idle_.push_front(&entry);
+		entry.idle = idle_.begin();
+		Trim();
+	}
+}
+
+void PatternCache::set_capacity(size_t capacity) {
+	capacity_ = capacity;
+	Trim();
+}
+
+void PatternCache::Trim() {
+	while (idle_.size() > capacity_) {
+		PatternCacheEntry *entry = idle_.back();
+		idle_.pop_back();
+		by_pattern_.erase(entry->pattern);
+		BytePattern::DestroyPattern(entry->pattern);
+		by_source_.erase(*entry->source);
+	}
+}
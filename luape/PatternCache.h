@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include "BytePattern.h"
+
+struct PatternCacheEntry {
+	Pattern *pattern;
+	size_t refs;
+	const std::string *source;
+	std::list<PatternCacheEntry *>::iterator idle; //valid while refs == 0
+};
+
+//shares one immutable compiled pattern between all users of the same source string,
+//patterns nobody references stay cached until more than capacity of them pile up
+class PatternCache {
+public:
+	static const size_t kDefaultCapacity = 1024;
+
+	explicit PatternCache(size_t capacity = kDefaultCapacity);
+	~PatternCache();
+
+	//returns nullptr for a malformed pattern, every other result must be given back with Release
+	Pattern * Acquire(const std::string& source);
+	//same, compile builds the pattern on a cache miss for callers holding it in compiled form
+	Pattern * Acquire(const std::string& source, const std::function<Pattern *()>& compile);
+	void Release(Pattern *pattern);
+
+	void set_capacity(size_t capacity);
+	size_t capacity() const { return capacity_; }
+	size_t size() const { return by_source_.size(); }
+private:
+	void Trim();
+
+	size_t capacity_;
+	std::unordered_map<std::string, PatternCacheEntry> by_source_;
+	std::unordered_map<const Pattern *, PatternCacheEntry *> by_pattern_;
+	std::list<PatternCacheEntry *> idle_; //most recently released first
+
+	PatternCache(PatternCache&) = delete;
+	void operator=(PatternCache) = delete;
+};
@@ -0,0 +1,240 @@
+#include "PatternIndex.h"
+#include <algorithm>
+
+static const char kMagic[4] = { 'L', 'P', 'I', 'X' };
+
+//padding and fill grams occur everywhere and would only bloat the postings, they are never indexed
+static bool IsStopGram(uint32_t gram) {
+	return gram == 0 || gram == 0xFFFFFFFF || gram == 0xCCCCCCCC || gram == 0x90909090;
+}
+
+static uint32_t GramBucket(uint32_t gram) {
+	return (gram * 2654435761u) >> (32 - PatternIndex::kBucketBits);
+}
+
+static uint32_t ReadGram(const uint8_t *pos) {
+	return pos[0] | (pos[1] << 8) | (pos[2] << 16) | (static_cast<uint32_t>(pos[3]) << 24);
+}
+
+PatternIndex::PatternIndex() : header_(nullptr), buckets_(nullptr), postings_(nullptr), file_(NULL), map_(NULL), view_(nullptr) {}
+
+PatternIndex::~PatternIndex() {
+	Unload();
+}
+
+void PatternIndex::Unload() {
+	if (view_) {
+		UnmapViewOfFile(view_);
+		CloseHandle(map_);
+		CloseHandle(file_);
+		view_ = nullptr;
+		map_ = NULL;
+		file_ = NULL;
+	}
+	owned_.clear();
+	header_ = nullptr;
+	buckets_ = nullptr;
+	postings_ = nullptr;
+}
+
+void PatternIndex::Attach(const uint8_t *base) {
+	header_ = reinterpret_cast<const PatternIndexHeader *>(base);
+	buckets_ = reinterpret_cast<const uint32_t *>(base + sizeof(PatternIndexHeader));
+	postings_ = buckets_ + (1 << header_->bucket_bits) + 1;
+}
+
+void PatternIndex::Build(const uint8_t *data, uint32_t size, uint64_t image_hash) {
+	Unload();
+
+	const uint32_t bucket_count = 1 << kBucketBits;
+	uint32_t grams = size >= kGramSize ? size - kGramSize + 1 : 0;
+	std::vector<uint32_t> counts(bucket_count + 1, 0);
+	uint32_t posting_count = 0;
+	for (uint32_t pos = 0; pos < grams; ++pos) {
+		uint32_t gram = ReadGram(data + pos);
+		if (!IsStopGram(gram)) {
+			++counts[GramBucket(gram) + 1];
+			++posting_count;
+		}
+	}
+
+	size_t header_words = sizeof(PatternIndexHeader) / sizeof(uint32_t);
+	owned_.resize(header_words + bucket_count + 1 + posting_count);
+	PatternIndexHeader *header = reinterpret_cast<PatternIndexHeader *>(&owned_[0]);
+	memcpy(header->magic, kMagic, sizeof(kMagic));
+	header->version = kVersion;
+	header->image_hash = image_hash;
+	header->image_size = size;
+	header->bucket_bits = kBucketBits;
+	header->posting_count = posting_count;
+	header->reserved = 0;
+
+	uint32_t *buckets = &owned_[header_words];
+	uint32_t *postings = buckets + bucket_count + 1;
+	for (uint32_t i = 0; i < bucket_count; ++i) {
+		counts[i + 1] += counts[i];
+	}
+	std::copy(counts.begin(), counts.end(), buckets);
+
+	//filling in file order keeps every bucket sorted
+	for (uint32_t pos = 0; pos < grams; ++pos) {
+		uint32_t gram = ReadGram(data + pos);
+		if (!IsStopGram(gram)) {
+			postings[counts[GramBucket(gram)]++] = pos;
+		}
+	}
+
+	Attach(reinterpret_cast<const uint8_t *>(&owned_[0]));
+}
+
+bool PatternIndex::Save(const char *path) const {
+	if (!header_) {
+		return false;
+	}
+
+	HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	const uint8_t *data = reinterpret_cast<const uint8_t *>(header_);
+	size_t size = reinterpret_cast<const uint8_t *>(postings_ + header_->posting_count) - data;
+	bool ok = true;
+	while (ok && size > 0) {
+		DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 64 * 1024 * 1024));
+		DWORD written = 0;
+		ok = WriteFile(file, data, chunk, &written, NULL) && written == chunk;
+		data += chunk;
+		size -= chunk;
+	}
+	CloseHandle(file);
+	return ok;
+}
+
+bool PatternIndex::Load(const char *path, uint64_t image_hash, uint32_t image_size) {
+	Unload();
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER file_size = { 0 };
+	GetFileSizeEx(file, &file_size);
+	if (file_size.QuadPart < static_cast<LONGLONG>(sizeof(PatternIndexHeader))) {
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE map = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	const void *view = map ? MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!view) {
+		if (map) {
+			CloseHandle(map);
+		}
+		CloseHandle(file);
+		return false;
+	}
+
+	const PatternIndexHeader *header = reinterpret_cast<const PatternIndexHeader *>(view);
+	bool valid = memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+		header->version == kVersion &&
+		header->image_hash == image_hash &&
+		header->image_size == image_size &&
+		header->bucket_bits == kBucketBits;
+	if (valid) {
+		LONGLONG expected = sizeof(PatternIndexHeader) + ((1LL << header->bucket_bits) + 1 + header->posting_count) * sizeof(uint32_t);
+		valid = file_size.QuadPart == expected;
+	}
+	if (valid) {
+		//lookups slice the postings with these offsets, they must start at 0, never decrease and end at the posting count
+		const uint32_t *buckets = reinterpret_cast<const uint32_t *>(header + 1);
+		uint32_t bucket_count = 1u << header->bucket_bits;
+		valid = buckets[0] == 0 && buckets[bucket_count] == header->posting_count;
+		for (uint32_t i = 0; valid && i < bucket_count; ++i) {
+			valid = buckets[i] <= buckets[i + 1];
+		}
+	}
+	if (!valid) {
+		UnmapViewOfFile(view);
+		CloseHandle(map);
+		CloseHandle(file);
+		return false;
+	}
+
+	file_ = file;
+	map_ = map;
+	view_ = view;
+	Attach(reinterpret_cast<const uint8_t *>(view));
+	return true;
+}
+
+bool PatternIndex::FindAll(Pattern *pattern, const uint8_t *data, uint32_t from, uint32_t to, const std::function<bool(uint32_t)>& visit) const {
+	if (!header_ || !pattern || pattern->span == 0) {
+		return false;
+	}
+
+	struct Gram {
+		uint32_t offset; //in the pattern
+		const uint32_t *begin;
+		const uint32_t *end;
+	};
+	std::vector<Gram> grams;
+	for (auto& s : pattern->segments) {
+		for (size_t i = 0; i + kGramSize <= s.bytes.size(); ++i) {
+			uint32_t gram = ReadGram(&s.bytes[i]);
+			if (IsStopGram(gram)) {
+				continue;
+			}
+			uint32_t bucket = GramBucket(gram);
+			Gram g = { s.pos + static_cast<uint32_t>(i), postings_ + buckets_[bucket], postings_ + buckets_[bucket + 1] };
+			grams.push_back(g);
+		}
+	}
+	if (grams.empty()) {
+		return false;
+	}
+
+	std::sort(grams.begin(), grams.end(), [](const Gram& a, const Gram& b) {
+		return a.end - a.begin < b.end - b.begin;
+	});
+	const Gram& first = grams[0];
+	const Gram *second = nullptr;
+	for (size_t i = 1; i < grams.size() && !second; ++i) {
+		if (grams[i].offset != first.offset) {
+			second = &grams[i];
+		}
+	}
+
+	//both postings are sorted, so each starts at the first position past from and the second one is walked once alongside the first
+	auto seek = [from](const Gram& gram) -> const uint32_t * {
+		uint64_t target = static_cast<uint64_t>(from) + gram.offset;
+		if (target > 0xFFFFFFFF) {
+			return gram.end;
+		}
+		return std::lower_bound(gram.begin, gram.end, static_cast<uint32_t>(target));
+	};
+	const uint32_t *other = second ? seek(*second) : nullptr;
+	for (const uint32_t *posting = seek(first); posting != first.end; ++posting) {
+		uint32_t start = *posting - first.offset;
+		if (start >= to || to - start < pattern->span) {
+			break;
+		}
+		if (second) {
+			uint32_t target = start + second->offset;
+			while (other != second->end && *other < target) {
+				++other;
+			}
+			if (other == second->end) {
+				break;
+			}
+			if (*other != target) {
+				continue;
+			}
+		}
+		if (BytePattern::Match(pattern, data + start, to - start) && !visit(start)) {
+			break;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <Windows.h>
+#include "BytePattern.h"
+
+//layout of an index file: header, (1 << bucket_bits) + 1 bucket offsets, posting_count file offsets
+struct PatternIndexHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t image_hash;
+	uint32_t image_size;
+	uint32_t bucket_bits;
+	uint32_t posting_count;
+	uint32_t reserved;
+};
+
+//maps every 4-byte gram of an image to the sorted file offsets it occurs at, a lookup intersects the postings
+//of the pattern's two rarest literal grams and only verifies those candidates
+class PatternIndex {
+public:
+	static const uint32_t kVersion = 1;
+	static const uint32_t kGramSize = 4;
+	static const uint32_t kBucketBits = 20;
+
+	PatternIndex();
+	~PatternIndex();
+
+	void Build(const uint8_t *data, uint32_t size, uint64_t image_hash);
+	bool Save(const char *path) const;
+	//maps an index file, fails when it was built for different image data
+	bool Load(const char *path, uint64_t image_hash, uint32_t image_size);
+
+	//returns false when the pattern has no indexable gram and has to be scanned linearly,
+	//otherwise visits the offsets of matches inside [from, to) in ascending order until visit returns false
+	bool FindAll(Pattern *pattern, const uint8_t *data, uint32_t from, uint32_t to, const std::function<bool(uint32_t)>& visit) const;
+
+	const PatternIndexHeader * header() const { return header_; }
+private:
+	void Unload();
+	void Attach(const uint8_t *base);
+
+	const PatternIndexHeader *header_;
+	const uint32_t *buckets_;
+	const uint32_t *postings_;
+	std::vector<uint32_t> owned_;
+	HANDLE file_;
+	HANDLE map_;
+	const void *view_;
+
+	PatternIndex(PatternIndex&) = delete;
+	void operator=(PatternIndex) = delete;
+};
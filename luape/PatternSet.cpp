@@ -0,0 +1,161 @@
+#include "PatternSet.h"
+#include <algorithm>
+
+static const size_t kPairCount = 0x10000;
+
+static void BuildBuckets(std::vector<PatternSetEntry>& entries, std::vector<uint32_t>& keys, std::vector<uint32_t>& buckets, size_t key_count) {
+	buckets.assign(key_count + 1, 0);
+	for (auto key : keys) {
+		++buckets[key + 1];
+	}
+	for (size_t i = 0; i < key_count; ++i) {
+		buckets[i + 1] += buckets[i];
+	}
+
+	std::vector<uint32_t> fill(buckets.begin(), buckets.end() - 1);
+	std::vector<PatternSetEntry> sorted(entries.size());
+	for (size_t i = 0; i < entries.size(); ++i) {
+		sorted[fill[keys[i]]++] = entries[i];
+	}
+	entries.swap(sorted);
+}
+
+PatternSet * BytePatternSet::CreatePatternSet(const std::vector<const char *>& patterns) {
+	std::vector<Pattern *> compiled;
+	for (auto source : patterns) {
+		Pattern *p = BytePattern::CreatePattern(source);
+		if (!p) {
+			for (auto done : compiled) {
+				BytePattern::DestroyPattern(done);
+			}
+			return nullptr;
+		}
+		compiled.push_back(p);
+	}
+	return CreatePatternSet(compiled);
+}
+
+PatternSet * BytePatternSet::CreatePatternSet(const std::vector<Pattern *>& patterns) {
+	PatternSet *set = new PatternSet();
+	std::vector<uint32_t> pair_keys, byte_keys;
+	set->max_span = 0;
+
+	for (size_t i = 0; i < patterns.size(); ++i) {
+		Pattern *p = patterns[i];
+		set->patterns.push_back(p);
+		set->max_span = std::max(set->max_span, p->span);
+
+		int best_pos = -1, best_score = 0;
+		uint32_t best_key = 0;
+		for (auto& s : p->segments) {
+			for (size_t j = 0; j + 1 < s.bytes.size(); ++j) {
+				int score = BytePattern::Commonness(s.bytes[j]) + BytePattern::Commonness(s.bytes[j + 1]);
+				if (best_pos < 0 || score < best_score) {
+					best_pos = s.pos + static_cast<int>(j);
+					best_score = score;
+					best_key = s.bytes[j] | (s.bytes[j + 1] << 8);
+				}
+			}
+		}
+
+		PatternSetEntry entry;
+		entry.index = static_cast<uint32_t>(i);
+		if (best_pos >= 0) {
+			entry.anchor = best_pos;
+			set->pair_entries.push_back(entry);
+			pair_keys.push_back(best_key);
+		}
+		else if (p->anchor_pos[0] >= 0) {
+			entry.anchor = p->anchor_pos[0];
+			set->byte_entries.push_back(entry);
+			byte_keys.push_back(p->anchor_byte[0]);
+		}
+		else if (p->span > 0) {
+			set->unanchored.push_back(entry.index);
+		}
+	}
+
+	BuildBuckets(set->pair_entries, pair_keys, set->pair_buckets, kPairCount);
+	BuildBuckets(set->byte_entries, byte_keys, set->byte_buckets, 0x100);
+
+	set->pair_filter.assign(kPairCount / 8, 0);
+	for (auto key : pair_keys) {
+		set->pair_filter[key / 8] |= 1 << (key % 8);
+	}
+
+	return set;
+}
+
+void BytePatternSet::DestroyPatternSet(PatternSet *set) {
+	if (set) {
+		for (auto p : set->patterns) {
+			BytePattern::DestroyPattern(p);
+		}
+		delete set;
+	}
+}
+
+void BytePatternSet::Find(PatternSet *set, const void *range_begin, size_t size, std::vector<const void *>& results) {
+	results.assign(set ? set->patterns.size() : 0, nullptr);
+	if (!set || size == 0) {
+		return;
+	}
+
+	const uint8_t *begin = reinterpret_cast<const uint8_t *>(range_begin);
+	size_t remaining = set->pair_entries.size() + set->byte_entries.size() + set->unanchored.size();
+
+	//a candidate found later always starts later, so the first hit per member is its first match
+	auto visit = [&](const PatternSetEntry *first, const PatternSetEntry *last, size_t pos) {
+		for (auto entry = first; entry != last; ++entry) {
+			if (results[entry->index] || pos < entry->anchor) {
+				continue;
+			}
+			size_t start = pos - entry->anchor;
+			if (BytePattern::Match(set->patterns[entry->index], begin + start, size - start)) {
+				results[entry->index] = begin + start;
+				--remaining;
+			}
+		}
+	};
+
+	//unanchored members with a Shift-And table advance their NFA state per byte instead of verifying every position
+	std::vector<uint64_t> states(set->unanchored.size(), 0);
+	bool has_unanchored = !set->unanchored.empty();
+
+	const uint8_t *filter = &set->pair_filter[0];
+	const uint32_t *pair_buckets = &set->pair_buckets[0];
+	const uint32_t *byte_buckets = &set->byte_buckets[0];
+	bool has_bytes = !set->byte_entries.empty();
+	for (size_t pos = 0; pos < size && remaining; ++pos) {
+		if (pos + 1 < size) {
+			uint32_t key = begin[pos] | (begin[pos + 1] << 8);
+			if (filter[key / 8] & (1 << (key % 8))) {
+				visit(&set->pair_entries[0] + pair_buckets[key], &set->pair_entries[0] + pair_buckets[key + 1], pos);
+			}
+		}
+		if (has_bytes) {
+			uint8_t key = begin[pos];
+			if (byte_buckets[key] != byte_buckets[key + 1]) {
+				visit(&set->byte_entries[0] + byte_buckets[key], &set->byte_entries[0] + byte_buckets[key + 1], pos);
+			}
+		}
+		for (size_t i = 0; has_unanchored && i < set->unanchored.size(); ++i) {
+			size_t index = set->unanchored[i];
+			Pattern *p = set->patterns[index];
+			if (results[index]) {
+				continue;
+			}
+			if (!p->shift_and.empty()) {
+				states[i] = ((states[i] << 1) | 1) & p->shift_and[begin[pos]];
+				if (states[i] & (1ULL << (p->span - 1))) {
+					results[index] = begin + pos + 1 - p->span;
+					--remaining;
+				}
+			}
+			else if (BytePattern::Match(p, begin + pos, size - pos)) {
+				results[index] = begin + pos;
+				--remaining;
+			}
+		}
+	}
+}
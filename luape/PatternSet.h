@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "BytePattern.h"
+
+struct PatternSetEntry {
+	uint32_t index; //member pattern
+	uint32_t anchor; //pattern offset of the prefilter bytes
+};
+
+struct PatternSet {
+	std::vector<Pattern *> patterns;
+	size_t max_span;
+	//members keyed by a rare literal byte pair, patterns without one are keyed by a single byte
+	std::vector<uint32_t> pair_buckets;
+	std::vector<PatternSetEntry> pair_entries;
+	std::vector<uint32_t> byte_buckets;
+	std::vector<PatternSetEntry> byte_entries;
+	std::vector<uint8_t> pair_filter; //one bit per byte pair that starts any bucket
+	std::vector<uint32_t> unanchored; //members without a full literal byte, run through their Shift-And table or verified at every position
+};
+
+class BytePatternSet {
+public:
+	//returns nullptr when any member is malformed
+	static PatternSet * CreatePatternSet(const std::vector<const char *>& patterns);
+	//takes ownership of already compiled members
+	static PatternSet * CreatePatternSet(const std::vector<Pattern *>& patterns);
+	static void DestroyPatternSet(PatternSet *set);
+	//results[i] receives the first match of member i or nullptr
+	static void Find(PatternSet *set, const void *range_begin, size_t size, std::vector<const void *>& results);
+};
@@ -0,0 +1,271 @@
+#include "SignatureDb.h"
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+static const char kMagic[4] = { 'L', 'P', 'S', 'D' };
+
+SignatureDb::SignatureDb() : header_(nullptr), records_(nullptr), file_(NULL), map_(NULL) {}
+
+SignatureDb::~SignatureDb() {
+	Close();
+}
+
+void SignatureDb::Close() {
+	if (header_) {
+		UnmapViewOfFile(header_);
+		CloseHandle(map_);
+		CloseHandle(file_);
+		header_ = nullptr;
+		records_ = nullptr;
+		map_ = NULL;
+		file_ = NULL;
+	}
+}
+
+bool SignatureDb::ParseText(const char *text, std::vector<std::pair<std::string, std::string>>& signatures, std::string& error) {
+	int line_number = 0;
+	for (const char *pos = text; *pos;) {
+		const char *line = pos;
+		for (; *pos && *pos != '\n'; ++pos);
+		std::string content(line, pos);
+		if (*pos) {
+			++pos;
+		}
+		++line_number;
+
+		auto trim = [](const std::string& str) -> std::string {
+			size_t first = 0, last = str.size();
+			for (; first < last && isspace(static_cast<unsigned char>(str[first])); ++first);
+			for (; last > first && isspace(static_cast<unsigned char>(str[last - 1])); --last);
+			return str.substr(first, last - first);
+		};
+		content = trim(content);
+		if (content.empty() || content[0] == '#') {
+			continue;
+		}
+		size_t equals = content.find('=');
+		//"=>" belongs to the pattern
+		if (equals == std::string::npos || equals == 0 || (equals + 1 < content.size() && content[equals + 1] == '>')) {
+			error = "line " + std::to_string(static_cast<long long>(line_number)) + " is not \"name = pattern\"";
+			return false;
+		}
+		signatures.push_back(std::make_pair(trim(content.substr(0, equals)), trim(content.substr(equals + 1))));
+	}
+	return true;
+}
+
+bool SignatureDb::Build(const std::vector<std::pair<std::string, std::string>>& signatures, const char *path, std::string& error) {
+	std::vector<size_t> order(signatures.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return signatures[a].first < signatures[b].first;
+	});
+	for (size_t i = 1; i < order.size(); ++i) {
+		if (signatures[order[i]].first == signatures[order[i - 1]].first) {
+			error = "duplicate signature name: " + signatures[order[i]].first;
+			return false;
+		}
+	}
+
+	std::vector<uint8_t> data(sizeof(SignatureDbHeader) + order.size() * sizeof(SignatureDbRecord));
+	std::vector<SignatureDbRecord> records(order.size());
+	auto append = [&](const void *bytes, size_t size, size_t align) -> uint32_t {
+		data.resize((data.size() + align - 1) / align * align);
+		uint32_t offset = static_cast<uint32_t>(data.size());
+		data.insert(data.end(), reinterpret_cast<const uint8_t *>(bytes), reinterpret_cast<const uint8_t *>(bytes) + size);
+		return offset;
+	};
+
+	for (size_t i = 0; i < order.size(); ++i) {
+		const std::string& name = signatures[order[i]].first;
+		const std::string& source = signatures[order[i]].second;
+		Pattern *p = BytePattern::CreatePattern(source.c_str());
+		if (name.empty() || !p) {
+			BytePattern::DestroyPattern(p);
+			error = "invalid signature: " + name;
+			return false;
+		}
+
+		SignatureDbRecord& record = records[i];
+		memset(&record, 0, sizeof(record));
+		record.name = append(name.c_str(), name.size() + 1, 1);
+		record.source = append(source.c_str(), source.size() + 1, 1);
+		record.span = static_cast<uint32_t>(p->span);
+		record.mask = append(p->span ? &p->mask[0] : nullptr, p->span, 1);
+		append(p->span ? &p->value[0] : nullptr, p->span, 1);
+		record.class_count = static_cast<uint32_t>(p->classes.size());
+		record.classes = append(p->classes.empty() ? nullptr : &p->classes[0], p->classes.size() * sizeof(ByteClass), 4);
+		std::vector<SignatureDbCapture> captures;
+		for (auto& capture : p->captures) {
+			SignatureDbCapture stored = { capture.pos, capture.size, static_cast<uint8_t>(capture.is_signed ? 1 : 0), 0 };
+			captures.push_back(stored);
+		}
+		record.capture_count = static_cast<uint32_t>(captures.size());
+		record.captures = append(captures.empty() ? nullptr : &captures[0], captures.size() * sizeof(SignatureDbCapture), 4);
+		std::vector<SignatureDbOp> ops;
+		for (auto& op : p->ops) {
+			SignatureDbOp stored = { static_cast<uint32_t>(op.type), 0, op.operand };
+			ops.push_back(stored);
+		}
+		record.op_count = static_cast<uint32_t>(ops.size());
+		record.ops = append(ops.empty() ? nullptr : &ops[0], ops.size() * sizeof(SignatureDbOp), 8);
+		BytePattern::DestroyPattern(p);
+	}
+
+	SignatureDbHeader header;
+	memcpy(header.magic, kMagic, sizeof(kMagic));
+	header.version = kVersion;
+	header.count = static_cast<uint32_t>(records.size());
+	header.file_size = static_cast<uint32_t>(data.size());
+	memcpy(&data[0], &header, sizeof(header));
+	if (!records.empty()) {
+		memcpy(&data[sizeof(header)], &records[0], records.size() * sizeof(SignatureDbRecord));
+	}
+
+	HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		error = std::string("cannot create ") + path;
+		return false;
+	}
+	DWORD written = 0;
+	bool ok = WriteFile(file, &data[0], static_cast<DWORD>(data.size()), &written, NULL) && written == data.size();
+	CloseHandle(file);
+	if (!ok) {
+		error = std::string("cannot write ") + path;
+	}
+	return ok;
+}
+
+bool SignatureDb::Open(const char *path) {
+	Close();
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER file_size = { 0 };
+	GetFileSizeEx(file, &file_size);
+	HANDLE map = file_size.QuadPart >= static_cast<LONGLONG>(sizeof(SignatureDbHeader)) ? CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	const void *view = map ? MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!view) {
+		if (map) {
+			CloseHandle(map);
+		}
+		CloseHandle(file);
+		return false;
+	}
+
+	file_ = file;
+	map_ = map;
+	header_ = reinterpret_cast<const SignatureDbHeader *>(view);
+	records_ = reinterpret_cast<const SignatureDbRecord *>(at(sizeof(SignatureDbHeader)));
+	if (header_->file_size != file_size.QuadPart || !Validate()) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+//checks every offset once so lookups can trust the records
+bool SignatureDb::Validate() const {
+	uint64_t size = header_->file_size;
+	if (memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0 || header_->version != kVersion ||
+		sizeof(SignatureDbHeader) + static_cast<uint64_t>(header_->count) * sizeof(SignatureDbRecord) > size) {
+		return false;
+	}
+	auto in_file = [size](uint32_t offset, uint64_t bytes) {
+		return offset <= size && bytes <= size - offset;
+	};
+	auto is_string = [&](uint32_t offset) {
+		return offset < size && memchr(at(offset), 0, static_cast<size_t>(size - offset)) != nullptr;
+	};
+	for (uint32_t i = 0; i < header_->count; ++i) {
+		const SignatureDbRecord& record = records_[i];
+		if (!is_string(record.name) || !is_string(record.source) ||
+			!in_file(record.mask, 2ULL * record.span) ||
+			!in_file(record.classes, static_cast<uint64_t>(record.class_count) * sizeof(ByteClass)) ||
+			!in_file(record.captures, static_cast<uint64_t>(record.capture_count) * sizeof(SignatureDbCapture)) ||
+			!in_file(record.ops, static_cast<uint64_t>(record.op_count) * sizeof(SignatureDbOp)) ||
+			record.classes % 4 != 0 || record.captures % 4 != 0 || record.ops % 8 != 0) {
+			return false;
+		}
+		if (i > 0 && strcmp(name(i - 1), name(i)) >= 0) {
+			return false;
+		}
+		const ByteClass *classes = reinterpret_cast<const ByteClass *>(at(record.classes));
+		for (uint32_t j = 0; j < record.class_count; ++j) {
+			if (classes[j].pos < 0 || static_cast<uint32_t>(classes[j].pos) >= record.span) {
+				return false;
+			}
+		}
+		const SignatureDbCapture *captures = reinterpret_cast<const SignatureDbCapture *>(at(record.captures));
+		for (uint32_t j = 0; j < record.capture_count; ++j) {
+			//captures are decoded as 1, 2, 4 or 8 byte integers, any other width has no meaning
+			uint32_t size = captures[j].size;
+			if (size != 1 && size != 2 && size != 4 && size != 8) {
+				return false;
+			}
+			if (captures[j].pos < 0 || static_cast<uint64_t>(captures[j].pos) + captures[j].size > record.span) {
+				return false;
+			}
+		}
+		const SignatureDbOp *ops = reinterpret_cast<const SignatureDbOp *>(at(record.ops));
+		for (uint32_t j = 0; j < record.op_count; ++j) {
+			if (ops[j].type > kOpDeref64) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+const char * SignatureDb::name(size_t index) const {
+	return index < count() ? reinterpret_cast<const char *>(at(records_[index].name)) : nullptr;
+}
+
+const char * SignatureDb::source(size_t index) const {
+	return index < count() ? reinterpret_cast<const char *>(at(records_[index].source)) : nullptr;
+}
+
+int SignatureDb::Find(const char *key) const {
+	size_t low = 0, high = count();
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		int cmp = strcmp(name(mid), key);
+		if (cmp == 0) {
+			return static_cast<int>(mid);
+		}
+		if (cmp < 0) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	return -1;
+}
+
+Pattern * SignatureDb::CreatePattern(size_t index) const {
+	if (index >= count()) {
+		return nullptr;
+	}
+	const SignatureDbRecord& record = records_[index];
+	const uint8_t *mask = at(record.mask);
+	Pattern *p = BytePattern::CreatePattern(mask, mask + record.span, record.span,
+		reinterpret_cast<const ByteClass *>(at(record.classes)), record.class_count);
+
+	const SignatureDbCapture *captures = reinterpret_cast<const SignatureDbCapture *>(at(record.captures));
+	for (uint32_t i = 0; i < record.capture_count; ++i) {
+		Capture capture = { captures[i].pos, captures[i].size, captures[i].is_signed != 0 };
+		p->captures.push_back(capture);
+	}
+	const SignatureDbOp *ops = reinterpret_cast<const SignatureDbOp *>(at(record.ops));
+	for (uint32_t i = 0; i < record.op_count; ++i) {
+		PatternOp op = { static_cast<PatternOpType>(ops[i].type), ops[i].operand };
+		p->ops.push_back(op);
+	}
+	return p;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <Windows.h>
+#include "BytePattern.h"
+
+//file layout: header, count records sorted by name, then the string and compiled byte data they point to,
+//every offset is from the start of the file
+struct SignatureDbHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+	uint32_t file_size;
+};
+
+struct SignatureDbRecord {
+	uint32_t name; //NUL terminated
+	uint32_t source; //NUL terminated pattern text, also the pattern cache key
+	uint32_t span;
+	uint32_t mask; //span mask bytes followed by span value bytes
+	uint32_t classes; //ByteClass array
+	uint32_t class_count;
+	uint32_t captures; //SignatureDbCapture array
+	uint32_t capture_count;
+	uint32_t ops; //SignatureDbOp array, 8 byte aligned
+	uint32_t op_count;
+};
+
+struct SignatureDbCapture {
+	int32_t pos;
+	uint8_t size;
+	uint8_t is_signed;
+	uint16_t reserved;
+};
+
+struct SignatureDbOp {
+	uint32_t type;
+	uint32_t reserved;
+	int64_t operand;
+};
+
+//named compiled patterns in a mapped file, opening costs one linear validation pass over the records and
+//patterns are rebuilt from their stored mask/value bytes on demand instead of being parsed from text
+class SignatureDb {
+public:
+	static const uint32_t kVersion = 1;
+
+	SignatureDb();
+	~SignatureDb();
+
+	//compiles every (name, pattern text) pair and writes the file, error names the first signature that failed
+	static bool Build(const std::vector<std::pair<std::string, std::string>>& signatures, const char *path, std::string& error);
+	//"name = pattern" per line, blank lines and lines starting with '#' are skipped
+	static bool ParseText(const char *text, std::vector<std::pair<std::string, std::string>>& signatures, std::string& error);
+
+	bool Open(const char *path);
+	void Close();
+
+	size_t count() const { return header_ ? header_->count : 0; }
+	const char * name(size_t index) const;
+	const char * source(size_t index) const;
+	//index of a name or -1
+	int Find(const char *name) const;
+	//new pattern owned by the caller, nullptr for a bad index
+	Pattern * CreatePattern(size_t index) const;
+private:
+	const uint8_t * at(uint32_t offset) const { return reinterpret_cast<const uint8_t *>(header_) + offset; }
+	bool Validate() const;
+
+	const SignatureDbHeader *header_;
+	const SignatureDbRecord *records_;
+	HANDLE file_;
+	HANDLE map_;
+
+	SignatureDb(SignatureDb&) = delete;
+	void operator=(SignatureDb) = delete;
+};
@@ -0,0 +1,71 @@
+#include "StreamScanner.h"
+#include <cstring>
+#include <algorithm>
+#include <Windows.h>
+#include "ParallelScan.h"
+
+StreamScanner::StreamScanner(Pattern *pattern, size_t window_size)
+	: pattern_(pattern), window_size_(window_size), carried_(0), consumed_(0) {
+	carry_ = pattern->span > 0 ? pattern->span - 1 : 0;
+	buffer_.resize(carry_ + window_size_);
+}
+
+bool StreamScanner::Commit(size_t size, const std::function<bool(uint64_t)>& visit) {
+	size_t total = carried_ + size;
+	uint64_t base = consumed_ - carried_;
+	consumed_ += size;
+
+	//a match starting in the carried bytes did not fit into the previous window, so none is reported twice
+	bool stopped = false;
+	if (pattern_->span > 0 && total >= pattern_->span) {
+		const uint8_t *begin = &buffer_[0];
+		ParallelScan::FindAll(pattern_, begin, total, [&](const void *match) -> bool {
+			if (!visit(base + (reinterpret_cast<const uint8_t *>(match) - begin))) {
+				stopped = true;
+				return false;
+			}
+			return true;
+		});
+	}
+
+	size_t keep = std::min<size_t>(carry_, total);
+	memmove(&buffer_[0], &buffer_[total - keep], keep);
+	carried_ = keep;
+	return !stopped;
+}
+
+bool StreamScanner::Feed(const void *data, size_t size, const std::function<bool(uint64_t)>& visit) {
+	const uint8_t *pos = reinterpret_cast<const uint8_t *>(data);
+	while (size > 0) {
+		size_t piece = std::min<size_t>(size, window_size_);
+		memcpy(window(), pos, piece);
+		if (!Commit(piece, visit)) {
+			return false;
+		}
+		pos += piece;
+		size -= piece;
+	}
+	return true;
+}
+
+bool StreamScanner::ScanFile(const char *path, Pattern *pattern, const std::function<bool(uint64_t)>& visit, size_t window_size) {
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	StreamScanner scanner(pattern, window_size);
+	bool ok = true;
+	for (;;) {
+		DWORD read = 0;
+		if (!ReadFile(file, scanner.window(), static_cast<DWORD>(scanner.window_size()), &read, NULL)) {
+			ok = false;
+			break;
+		}
+		if (read == 0 || !scanner.Commit(read, visit)) {
+			break;
+		}
+	}
+	CloseHandle(file);
+	return ok;
+}
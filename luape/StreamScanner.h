@@ -0,0 +1,34 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include "BytePattern.h"
+
+//scans input that arrives in pieces with bounded memory, the last span - 1 bytes of each window are carried
+//into the next one so matches crossing a window boundary are found exactly once, offsets are absolute
+class StreamScanner {
+public:
+	static const size_t kDefaultWindowSize = 64 * 1024 * 1024;
+
+	StreamScanner(Pattern *pattern, size_t window_size = kDefaultWindowSize);
+
+	//space for the next piece of input, window_size() bytes
+	uint8_t * window() { return &buffer_[carried_]; }
+	size_t window_size() const { return window_size_; }
+	//scans the carried bytes plus size bytes written to window(), returns false once visit stopped the scan
+	bool Commit(size_t size, const std::function<bool(uint64_t)>& visit);
+	//copies arbitrary sized input through the window
+	bool Feed(const void *data, size_t size, const std::function<bool(uint64_t)>& visit);
+	uint64_t consumed() const { return consumed_; }
+
+	//reads a file of any size window by window, returns false when it cannot be opened or read
+	static bool ScanFile(const char *path, Pattern *pattern, const std::function<bool(uint64_t)>& visit, size_t window_size = kDefaultWindowSize);
+private:
+	Pattern *pattern_;
+	size_t window_size_;
+	size_t carry_; //span - 1
+	size_t carried_; //bytes currently carried at the start of buffer_
+	uint64_t consumed_;
+	std::vector<uint8_t> buffer_;
+};
@@ -0,0 +1,61 @@
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(size_t threads) : task_(nullptr), next_(0), count_(0), finished_(0), stop_(false) {
+	for (size_t i = 1; i < threads; ++i) {
+		threads_.push_back(std::thread(&WorkerPool::WorkerMain, this));
+	}
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	wake_.notify_all();
+	for (auto& t : threads_) {
+		t.join();
+	}
+}
+
+void WorkerPool::Run(size_t count, const std::function<void(size_t)>& task) {
+	if (count == 0) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	task_ = &task;
+	next_ = 0;
+	count_ = count;
+	finished_ = 0;
+	wake_.notify_all();
+
+	RunTasks(lock);
+	done_.wait(lock, [this] { return finished_ == count_; });
+	task_ = nullptr;
+	count_ = 0;
+}
+
+//called with the lock held, releases it while a task runs
+void WorkerPool::RunTasks(std::unique_lock<std::mutex>& lock) {
+	while (next_ < count_) {
+		size_t index = next_++;
+		const std::function<void(size_t)>& task = *task_;
+		lock.unlock();
+		task(index);
+		lock.lock();
+		if (++finished_ == count_) {
+			done_.notify_all();
+		}
+	}
+}
+
+void WorkerPool::WorkerMain() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true) {
+		wake_.wait(lock, [this] { return stop_ || next_ < count_; });
+		if (stop_) {
+			break;
+		}
+		RunTasks(lock);
+	}
+}
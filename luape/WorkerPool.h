@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+class WorkerPool {
+public:
+	//threads includes the calling thread, which takes part in every Run
+	explicit WorkerPool(size_t threads);
+	~WorkerPool();
+
+	//runs task(0) .. task(count - 1) across the pool and returns when all of them are done
+	void Run(size_t count, const std::function<void(size_t)>& task);
+
+	size_t size() const { return threads_.size() + 1; }
+private:
+	void WorkerMain();
+	void RunTasks(std::unique_lock<std::mutex>& lock);
+
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable done_;
+	const std::function<void(size_t)> *task_;
+	size_t next_;
+	size_t count_;
+	size_t finished_;
+	bool stop_;
+
+	WorkerPool(WorkerPool&) = delete;
+	void operator=(WorkerPool) = delete;
+};